@@ -0,0 +1,50 @@
+-- Check of the median() results of the benchmark datasets against the
+-- built-in percentile_cont(0.5), or percentile_disc(0.5) for text, over the
+-- whole tables and per group.  Fails if any of them differs:
+--
+--   psql -X -v ON_ERROR_STOP=1 -f bench/check.sql
+--
+-- Medians of an even number of integers are truncated to integers, so they
+-- may differ by up to a half from percentile_cont().  The groups of the text
+-- table have an even number of rows, so percentiles() is checked for it.
+
+CREATE FUNCTION pg_temp.check_median(relname text, median text, baseline text,
+									 differs text, OUT whole_differs bool,
+									 OUT groups_differing int8)
+LANGUAGE plpgsql AS $$
+BEGIN
+	EXECUTE format('SELECT %s FROM (SELECT %s AS m, %s AS b FROM bench.%I) AS s',
+				   differs, median, baseline, relname)
+		INTO whole_differs;
+	EXECUTE format('SELECT count(*) FILTER (WHERE %s) FROM (SELECT %s AS m, %s AS b FROM bench.%I GROUP BY grp) AS s',
+				   differs, median, baseline, relname)
+		INTO groups_differing;
+END
+$$;
+
+CREATE TEMP TABLE bench_check AS
+SELECT t.relname, c.*
+FROM (VALUES
+	  ('uniform_int8', 'median(val)', 'percentile_cont', 'abs(m - b) > 0.5'),
+	  ('skewed_int8', 'median(val)', 'percentile_cont', 'abs(m - b) > 0.5'),
+	  ('uniform_float8', 'median(val)', 'percentile_cont', 'abs(m - b) > 1e-12 * abs(b)'),
+	  ('uniform_numeric', 'median(val)', 'percentile_cont', 'abs(m - b) > 1e-12 * abs(b)'),
+	  ('collated_text', '(percentiles(val, ''{0.5}''))[1]', 'percentile_disc', 'm IS DISTINCT FROM b'),
+	  ('duplicate_int8', 'median(val)', 'percentile_cont', 'abs(m - b) > 0.5'),
+	  ('sorted_int8', 'median(val)', 'percentile_cont', 'abs(m - b) > 0.5'),
+	  ('reversed_int8', 'median(val)', 'percentile_cont', 'abs(m - b) > 0.5'))
+	  AS t(relname, median, baseline, differs),
+	 LATERAL pg_temp.check_median(t.relname, t.median,
+								  t.baseline || '(0.5) WITHIN GROUP (ORDER BY val)',
+								  t.differs) AS c;
+
+SELECT * FROM bench_check;
+
+DO $$
+BEGIN
+	IF EXISTS (SELECT FROM bench_check
+			   WHERE whole_differs OR groups_differing > 0) THEN
+		RAISE EXCEPTION 'median() differs from the built-in percentiles';
+	END IF;
+END
+$$;
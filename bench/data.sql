@@ -0,0 +1,76 @@
+-- Datasets of the median() benchmark.
+--
+-- Creates the tables of the schema bench with the given number of rows,
+-- generated from fixed seeds so that every run measures the same data:
+--
+--   psql -X -v rows=1000000 -v collation=default -f bench/data.sql
+--
+-- Each table has an id in insertion order, the value val and grp, which
+-- splits the rows into 100 groups.  The text table has one row more, so
+-- that its median is one of the values.
+
+SET client_min_messages = warning;
+
+CREATE EXTENSION IF NOT EXISTS median;
+DROP SCHEMA IF EXISTS bench CASCADE;
+CREATE SCHEMA bench;
+
+CREATE TABLE bench.meta AS SELECT :rows::int8 AS rows;
+
+SELECT setseed(0.1);
+CREATE TABLE bench.uniform_int8 AS
+SELECT i AS id, (random() * 1e12)::int8 AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+-- Power-law skew: most values are small, a few are huge
+SELECT setseed(0.2);
+CREATE TABLE bench.skewed_int8 AS
+SELECT i AS id, (power(random(), 8) * 1e12)::int8 AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+SELECT setseed(0.3);
+CREATE TABLE bench.uniform_float8 AS
+SELECT i AS id, random() * 1e6 AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+SELECT setseed(0.4);
+CREATE TABLE bench.uniform_numeric AS
+SELECT i AS id, round((random() * 1e6)::numeric, 4) AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+SELECT setseed(0.5);
+CREATE TABLE bench.collated_text AS
+SELECT i AS id, md5((random() * 1e15)::int8::text) COLLATE :"collation" AS val, (i % 100)::int4 AS grp
+FROM generate_series(0, :rows) AS t(i);
+
+-- Heavy duplicates: a thousand distinct values
+SELECT setseed(0.6);
+CREATE TABLE bench.duplicate_int8 AS
+SELECT i AS id, (random() * 1000)::int8 AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+CREATE TABLE bench.sorted_int8 AS
+SELECT i AS id, i::int8 * 7 AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+CREATE TABLE bench.reversed_int8 AS
+SELECT i AS id, (:rows - i)::int8 * 7 AS val, (i % 100)::int4 AS grp
+FROM generate_series(1, :rows) AS t(i);
+
+ALTER TABLE bench.uniform_int8 SET (parallel_workers = 4);
+ALTER TABLE bench.skewed_int8 SET (parallel_workers = 4);
+ALTER TABLE bench.uniform_float8 SET (parallel_workers = 4);
+ALTER TABLE bench.uniform_numeric SET (parallel_workers = 4);
+ALTER TABLE bench.collated_text SET (parallel_workers = 4);
+ALTER TABLE bench.duplicate_int8 SET (parallel_workers = 4);
+ALTER TABLE bench.sorted_int8 SET (parallel_workers = 4);
+ALTER TABLE bench.reversed_int8 SET (parallel_workers = 4);
+
+VACUUM ANALYZE bench.uniform_int8;
+VACUUM ANALYZE bench.skewed_int8;
+VACUUM ANALYZE bench.uniform_float8;
+VACUUM ANALYZE bench.uniform_numeric;
+VACUUM ANALYZE bench.collated_text;
+VACUUM ANALYZE bench.duplicate_int8;
+VACUUM ANALYZE bench.sorted_int8;
+VACUUM ANALYZE bench.reversed_int8;
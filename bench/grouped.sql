@@ -0,0 +1,2 @@
+-- pgbench script: the aggregate :agg over 100 groups of the table :table
+SELECT count(*) FROM (SELECT :agg FROM :table GROUP BY grp) AS s;
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Benchmark of median() against the built-in percentiles, run by make bench
+# against a database with the extension installed:
+#
+#   ROWS=1000000 sh bench/run.sh
+#
+# The datasets are generated by bench/data.sql, unless the schema bench
+# already has ROWS rows.  Each query runs TRANSACTIONS times under pgbench,
+# and the average latency is reported.  The results of median() are then
+# checked by bench/check.sql.
+#
+# Settings are taken from the environment: ROWS (1000000), TRANSACTIONS (5),
+# BENCH_COLLATION (default), the collation of the text values, and PGBIN, the
+# directory of psql and pgbench.  The connection is set up by the usual
+# libpq variables, such as PGDATABASE.
+
+set -e
+
+ROWS=${ROWS:-1000000}
+TRANSACTIONS=${TRANSACTIONS:-5}
+COLLATION=${BENCH_COLLATION:-default}
+DIR=$(dirname "$0")
+
+if [ -n "$PGBIN" ]; then
+	PSQL="$PGBIN/psql"
+	PGBENCH="$PGBIN/pgbench"
+else
+	PSQL=psql
+	PGBENCH=pgbench
+fi
+
+psql_q()
+{
+	"$PSQL" -X -q -v ON_ERROR_STOP=1 "$@"
+}
+
+existing=$(psql_q -A -t -c "SELECT rows FROM bench.meta" 2>/dev/null || true)
+if [ "$existing" != "$ROWS" ]; then
+	echo "generating datasets of $ROWS rows"
+	psql_q -v rows="$ROWS" -v collation="$COLLATION" -f "$DIR/data.sql" >/dev/null
+fi
+
+# Average latency of the script $1 over the table $2 with the aggregate $3,
+# in the parallel mode $4
+latency()
+{
+	if [ "$4" = parallel ]; then
+		workers=4
+	else
+		workers=0
+	fi
+
+	PGOPTIONS="-c max_parallel_workers_per_gather=$workers -c work_mem=64MB" \
+		"$PGBENCH" -n -t "$TRANSACTIONS" -D table="bench.$2" -D agg="$3" \
+		-f "$DIR/$1.sql" 2>/dev/null |
+		sed -n 's/^latency average = \([0-9.]*\) ms$/\1/p'
+}
+
+printf '%-16s %-10s %-9s %12s %12s\n' table query mode "median ms" "builtin ms"
+
+for table in uniform_int8 skewed_int8 uniform_float8 uniform_numeric \
+	collated_text duplicate_int8 sorted_int8 reversed_int8
+do
+	if [ "$table" = collated_text ]; then
+		# median() of an even number of text values has no mean
+		agg="percentiles(val, '{0.5}')"
+		builtin="percentile_disc(0.5) WITHIN GROUP (ORDER BY val)"
+	else
+		agg="median(val)"
+		builtin="percentile_cont(0.5) WITHIN GROUP (ORDER BY val)"
+	fi
+
+	for query in ungrouped grouped; do
+		for mode in serial parallel; do
+			printf '%-16s %-10s %-9s %12s %12s\n' "$table" "$query" "$mode" \
+				"$(latency $query $table "$agg" $mode)" \
+				"$(latency $query $table "$builtin" $mode)"
+		done
+	done
+
+	# The built-in percentiles are not window functions
+	if [ "$table" != collated_text ]; then
+		printf '%-16s %-10s %-9s %12s %12s\n' "$table" window serial \
+			"$(latency window $table "$agg" serial)" -
+	fi
+done
+
+psql_q -f "$DIR/check.sql"
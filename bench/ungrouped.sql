@@ -0,0 +1,2 @@
+-- pgbench script: the aggregate :agg over the whole table :table
+SELECT :agg FROM :table;
@@ -0,0 +1,3 @@
+-- pgbench script: the aggregate :agg over a sliding frame of 1000 rows of
+-- the table :table
+SELECT count(*) FROM (SELECT :agg OVER (ORDER BY id ROWS BETWEEN 999 PRECEDING AND CURRENT ROW) FROM :table) AS s;
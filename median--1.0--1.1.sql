@@ -0,0 +1,369 @@
+CREATE OR REPLACE FUNCTION _median_moving_transfn(state internal, val anyelement)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_moving_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_moving_invfn(state internal, val anyelement)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_moving_invfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_moving_finalfn(state internal, val anyelement)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'median_moving_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+-- median(ANYELEMENT) gets the moving-aggregate functions.  From PostgreSQL 12
+-- on it is replaced in place, which keeps the views using it and its
+-- privileges.  Older servers have to drop and create it again, so there the
+-- update fails while views depend on median(), and its privileges are lost.
+DO $$
+DECLARE
+    in_place bool := current_setting('server_version_num')::int >= 120000;
+BEGIN
+    IF NOT in_place THEN
+        DROP AGGREGATE median (ANYELEMENT);
+    END IF;
+
+    EXECUTE (CASE WHEN in_place THEN 'CREATE OR REPLACE' ELSE 'CREATE' END) || $agg$
+        AGGREGATE median (ANYELEMENT)
+        (
+            sfunc = _median_transfn,
+            stype = internal,
+            sspace = 1024,
+            combinefunc = _median_combinefn,
+            serialfunc = _median_serializefn,
+            deserialfunc = _median_deserializefn,
+            parallel = safe,
+            finalfunc = _median_finalfn,
+            finalfunc_extra,
+            msfunc = _median_moving_transfn,
+            minvfunc = _median_moving_invfn,
+            mstype = internal,
+            mfinalfunc = _median_moving_finalfn,
+            mfinalfunc_extra
+        )$agg$;
+END
+$$;
+
+CREATE OR REPLACE FUNCTION _median_weighted_transfn(state internal, val anyelement, weight int8)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_weighted_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_finalfn(state internal, val anyelement, weight int8)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'median_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median (ANYELEMENT, int8);
+CREATE AGGREGATE median (ANYELEMENT, int8)
+(
+    sfunc = _median_weighted_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_finalfn,
+    finalfunc_extra
+);
+
+CREATE OR REPLACE FUNCTION _median_cont_finalfn(state internal)
+RETURNS numeric
+AS 'MODULE_PATHNAME', 'median_cont_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_cont_float8_finalfn(state internal)
+RETURNS float8
+AS 'MODULE_PATHNAME', 'median_cont_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median_cont (int2);
+CREATE AGGREGATE median_cont (int2)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_cont_finalfn
+);
+
+DROP AGGREGATE IF EXISTS median_cont (int4);
+CREATE AGGREGATE median_cont (int4)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_cont_finalfn
+);
+
+DROP AGGREGATE IF EXISTS median_cont (int8);
+CREATE AGGREGATE median_cont (int8)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_cont_finalfn
+);
+
+DROP AGGREGATE IF EXISTS median_cont (numeric);
+CREATE AGGREGATE median_cont (numeric)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_cont_finalfn
+);
+
+DROP AGGREGATE IF EXISTS median_cont (float8);
+CREATE AGGREGATE median_cont (float8)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_cont_float8_finalfn
+);
+
+CREATE OR REPLACE FUNCTION _percentiles_transfn(state internal, val anyelement, fractions float8[])
+RETURNS internal
+AS 'MODULE_PATHNAME', 'percentiles_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _percentiles_finalfn(state internal, val anyelement, fractions float8[])
+RETURNS anyarray
+AS 'MODULE_PATHNAME', 'percentiles_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS percentiles (ANYELEMENT, float8[]);
+CREATE AGGREGATE percentiles (ANYELEMENT, float8[])
+(
+    sfunc = _percentiles_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _percentiles_finalfn,
+    finalfunc_extra
+);
+
+CREATE OR REPLACE FUNCTION array_median(anyarray)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'array_median'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_array_transfn(state internal, val float8[])
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_array_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_array_finalfn(state internal)
+RETURNS float8[]
+AS 'MODULE_PATHNAME', 'median_array_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median_elementwise (float8[]);
+CREATE AGGREGATE median_elementwise (float8[])
+(
+    sfunc = _median_array_transfn,
+    stype = internal,
+    parallel = safe,
+    finalfunc = _median_array_finalfn
+);
+
+CREATE OR REPLACE FUNCTION _approx_median_transfn(state internal, val anyelement)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_transfn(state internal, val anyelement, accuracy float8)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_finalfn(state internal, val anyelement)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'approx_median_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_finalfn(state internal, val anyelement, accuracy float8)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'approx_median_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_combinefn(internal, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_combinefn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_serializefn(internal)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'approx_median_serializefn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _approx_median_deserializefn(bytea, internal)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'approx_median_deserializefn'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS approx_median (ANYELEMENT);
+CREATE AGGREGATE approx_median (ANYELEMENT)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    combinefunc = _approx_median_combinefn,
+    serialfunc = _approx_median_serializefn,
+    deserialfunc = _approx_median_deserializefn,
+    parallel = safe,
+    finalfunc = _approx_median_finalfn,
+    finalfunc_extra
+);
+
+DROP AGGREGATE IF EXISTS approx_median (ANYELEMENT, float8);
+CREATE AGGREGATE approx_median (ANYELEMENT, float8)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    combinefunc = _approx_median_combinefn,
+    serialfunc = _approx_median_serializefn,
+    deserialfunc = _approx_median_deserializefn,
+    parallel = safe,
+    finalfunc = _approx_median_finalfn,
+    finalfunc_extra
+);
+
+CREATE TYPE median_state;
+
+CREATE OR REPLACE FUNCTION median_state_in(cstring)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_state_in'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_out(median_state)
+RETURNS cstring
+AS 'MODULE_PATHNAME', 'median_state_out'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_recv(internal)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_state_recv'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_state_send(median_state)
+RETURNS bytea
+AS 'MODULE_PATHNAME', 'median_state_send'
+LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE median_state (
+    input = median_state_in,
+    output = median_state_out,
+    receive = median_state_recv,
+    send = median_state_send,
+    internallength = variable,
+    alignment = int4,
+    storage = extended
+);
+
+CREATE CAST (median_state AS bytea) WITHOUT FUNCTION;
+
+CREATE OR REPLACE FUNCTION _median_partial_finalfn(state internal)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_partial_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median_partial (ANYELEMENT);
+CREATE AGGREGATE median_partial (ANYELEMENT)
+(
+    sfunc = _median_transfn,
+    stype = internal,
+    sspace = 1024,
+    combinefunc = _median_combinefn,
+    serialfunc = _median_serializefn,
+    deserialfunc = _median_deserializefn,
+    parallel = safe,
+    finalfunc = _median_partial_finalfn
+);
+
+CREATE OR REPLACE FUNCTION _approx_median_partial_finalfn(state internal)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'approx_median_partial_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS approx_median_partial (ANYELEMENT);
+CREATE AGGREGATE approx_median_partial (ANYELEMENT)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    combinefunc = _approx_median_combinefn,
+    serialfunc = _approx_median_serializefn,
+    deserialfunc = _approx_median_deserializefn,
+    parallel = safe,
+    finalfunc = _approx_median_partial_finalfn
+);
+
+DROP AGGREGATE IF EXISTS approx_median_partial (ANYELEMENT, float8);
+CREATE AGGREGATE approx_median_partial (ANYELEMENT, float8)
+(
+    sfunc = _approx_median_transfn,
+    stype = internal,
+    combinefunc = _approx_median_combinefn,
+    serialfunc = _approx_median_serializefn,
+    deserialfunc = _approx_median_deserializefn,
+    parallel = safe,
+    finalfunc = _approx_median_partial_finalfn
+);
+
+CREATE OR REPLACE FUNCTION _median_merge_transfn(state internal, val median_state)
+RETURNS internal
+AS 'MODULE_PATHNAME', 'median_merge_transfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION _median_merge_finalfn(state internal)
+RETURNS median_state
+AS 'MODULE_PATHNAME', 'median_merge_finalfn'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+DROP AGGREGATE IF EXISTS median_merge (median_state);
+CREATE AGGREGATE median_merge (median_state)
+(
+    sfunc = _median_merge_transfn,
+    stype = internal,
+    parallel = safe,
+    finalfunc = _median_merge_finalfn
+);
+
+CREATE OR REPLACE FUNCTION median_final(state median_state, val anyelement)
+RETURNS anyelement
+AS 'MODULE_PATHNAME', 'median_final'
+LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION median_last_stats(
+    OUT path text, OUT values_num int8, OUT memory_bytes int8,
+    OUT spilled_bytes int8, OUT resizes int8, OUT spills int8,
+    OUT combines int8, OUT deserialized_bytes int8,
+    OUT deserialize_time float8, OUT comparisons int8, OUT final_time float8)
+RETURNS record
+AS 'MODULE_PATHNAME', 'median_last_stats'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
@@ -1,10 +1,23 @@
 #include <postgres.h>
+#include <access/xact.h>
 #include <catalog/namespace.h>
+#include <catalog/pg_type.h>
+#include <access/htup_details.h>
+#include <funcapi.h>
 #include <libpq/pqformat.h>
+#include <math.h>
+#include <miscadmin.h>
 #include <nodes/value.h>
+#include <portability/instr_time.h>
+#include <storage/buffile.h>
+#include <utils/array.h>
 #include <utils/builtins.h>
 #include <utils/datum.h>
+#include <utils/guc.h>
 #include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/sortsupport.h>
+#include <utils/syscache.h>
 #include <utils/typcache.h>
 
 #ifdef PG_MODULE_MAGIC
@@ -14,223 +27,6360 @@ PG_MODULE_MAGIC;
 /* aggregate median:
  *	 median(value) returns the median value of a values passed into the function
  *
+ * aggregate percentiles:
+ *	 percentiles(value, fractions) returns an array of the values at the given
+ *	 fractions of the ordered values, as percentile_disc() does
+ *
+ * aggregate approx_median:
+ *	 approx_median(value [, accuracy]) returns an approximation of the median
+ *	 using bounded memory
+ *
  * Usage:
  *	 SELECT median(field) FROM table.
  */
 
 PG_FUNCTION_INFO_V1(median_transfn);
+PG_FUNCTION_INFO_V1(median_weighted_transfn);
 PG_FUNCTION_INFO_V1(median_finalfn);
+PG_FUNCTION_INFO_V1(median_cont_finalfn);
 PG_FUNCTION_INFO_V1(median_combinefn);
 PG_FUNCTION_INFO_V1(median_serializefn);
 PG_FUNCTION_INFO_V1(median_deserializefn);
+PG_FUNCTION_INFO_V1(percentiles_transfn);
+PG_FUNCTION_INFO_V1(percentiles_finalfn);
+PG_FUNCTION_INFO_V1(array_median);
+PG_FUNCTION_INFO_V1(median_array_transfn);
+PG_FUNCTION_INFO_V1(median_array_finalfn);
+PG_FUNCTION_INFO_V1(median_moving_transfn);
+PG_FUNCTION_INFO_V1(median_moving_invfn);
+PG_FUNCTION_INFO_V1(median_moving_finalfn);
+PG_FUNCTION_INFO_V1(approx_median_transfn);
+PG_FUNCTION_INFO_V1(approx_median_finalfn);
+PG_FUNCTION_INFO_V1(approx_median_combinefn);
+PG_FUNCTION_INFO_V1(approx_median_serializefn);
+PG_FUNCTION_INFO_V1(approx_median_deserializefn);
+PG_FUNCTION_INFO_V1(median_last_stats);
+PG_FUNCTION_INFO_V1(median_state_in);
+PG_FUNCTION_INFO_V1(median_state_out);
+PG_FUNCTION_INFO_V1(median_state_recv);
+PG_FUNCTION_INFO_V1(median_state_send);
+PG_FUNCTION_INFO_V1(median_partial_finalfn);
+PG_FUNCTION_INFO_V1(approx_median_partial_finalfn);
+PG_FUNCTION_INFO_V1(median_merge_transfn);
+PG_FUNCTION_INFO_V1(median_merge_finalfn);
+PG_FUNCTION_INFO_V1(median_final);
 
-/* Internal state used by median aggregate function */
-typedef struct MedianState
+void		_PG_init(void);
+
+/* Whether the states of median() and percentiles() collect statistics */
+static bool median_track_stats = false;
+
+/*
+ * Representation of accumulated values.
+ *
+ * Values of the most common fixed-width by-value types are stored as native
+ * integers or floats, so that they can be compared inline.  Values of any
+ * other type are stored as Datums and compared using the type's btree
+ * comparison function.
+ */
+typedef enum MedianValuesKind
+{
+	MEDIAN_VALUES_DATUM,		/* any type, Datums */
+	MEDIAN_VALUES_INT64,		/* int2, int4, int8, date, timestamp[tz] */
+	MEDIAN_VALUES_FLOAT8		/* float4, float8 */
+}	MedianValuesKind;
+
+/* Size of a single element of the array values */
+#define MEDIAN_VALUE_SIZE(state) \
+	((state)->type->values_kind == MEDIAN_VALUES_DATUM ? sizeof(Datum) : \
+	 (state)->type->values_kind == MEDIAN_VALUES_INT64 ? sizeof(int64) : \
+	 sizeof(float8))
+
+/*
+ * Chunk of memory holding by-reference values of a state.  The values are
+ * copied one after another into chunks, rather than allocated one by one, to
+ * save allocation overhead and keep them close to each other.
+ */
+typedef struct MedianArenaChunk
+{
+	struct MedianArenaChunk *next;
+	/* Usable size of the chunk, the values follow the header */
+	Size		size;
+}	MedianArenaChunk;
+
+#define ARENA_CHUNK_HEADER	MAXALIGN(sizeof(MedianArenaChunk))
+/* Sizes of the chunks double from the minimal to the maximal size */
+#define ARENA_MIN_CHUNK		(8 * 1024)
+#define ARENA_MAX_CHUNK		(1024 * 1024)
+/* Values larger than this get a chunk of their own */
+#define ARENA_LARGE_VALUE	(ARENA_MAX_CHUNK / 8)
+
+/*
+ * Entry of the hash table counting occurrences of distinct integer values.
+ * Entries with zero count are empty.
+ */
+typedef struct MedianCountsEntry
+{
+	int64		value;
+	uint64		count;
+}	MedianCountsEntry;
+
+/*
+ * Integer values are counted instead of being kept one by one, if there are
+ * at least COUNTS_MIN_DUPS times fewer distinct values than values.  This is
+ * checked each time the number of values reaches a power of two between
+ * COUNTS_CHECK_MIN and COUNTS_CHECK_MAX.
+ */
+#define COUNTS_MIN_DUPS		8
+#define COUNTS_CHECK_MIN	1024
+#define COUNTS_CHECK_MAX	(64 * 1024)
+/*
+ * Largest allocated length of the hash table.  It's a power of two, as the
+ * lengths the table is doubled to are, and the 256MB table of that length
+ * fits into MaxAllocSize with room to spare.
+ */
+#define COUNTS_MAX_ALLOC	((uint32) 1 << 24)
+
+/*
+ * Statistics of a state, collected if median.track_stats is on.  They are
+ * reported by the final function and kept as the last statistics of the
+ * backend, returned by median_last_stats().
+ */
+typedef struct MedianStats
+{
+	/* Algorithm the final function found the result with */
+	const char *path;
+	/* Number of values, and bytes taken in memory and in the file */
+	uint64		values_num;
+	uint64		memory_bytes;
+	uint64		spilled_bytes;
+	/* Reallocations of the values array and writes into the file */
+	uint64		resizes;
+	uint64		spills;
+	/* Partial states combined into the state */
+	uint64		combines;
+	/* Comparisons done by the type's comparison function */
+	uint64		comparisons;
+	/* Size of the deserialized partial states and time taken on them */
+	uint64		deserialized_bytes;
+	double		deserialize_ms;
+	/* Time taken by the final function */
+	double		final_ms;
+
+	/* Start of the running final function */
+	instr_time	final_start;
+	uint64		final_comparisons;
+}	MedianStats;
+
+/* Statistics of the last state finalized by the backend */
+static MedianStats last_stats;
+static bool last_stats_valid = false;
+
+/*
+ * Number of comparisons done by the comparison functions of the argument
+ * types.  Native integers and floats are compared inline and aren't counted.
+ * Comparisons are only counted with median.track_stats on, see
+ * COUNT_COMPARISON().
+ */
+static uint64 median_comparisons = 0;
+
+/*
+ * Count a comparison for the statistics.  With median.track_stats off this
+ * is a well-predicted branch on a flag which isn't written while values are
+ * compared, rather than a write to a global for every comparison.
+ */
+#define COUNT_COMPARISON() \
+	do { \
+		if (unlikely(median_track_stats)) \
+			median_comparisons++; \
+	} while (0)
+
+/*
+ * Number of values kept in the state itself.  The aggregates declare an
+ * sspace of 1024 bytes, about the size of a state holding the inline values
+ * and an array of 64 more.
+ */
+#define MEDIAN_INLINE_VALUES	8
+
+/*
+ * Argument type of the states along with its routines.  It's the same for all
+ * the groups of an aggregate, so it's looked up once, cached in fn_extra of
+ * the function creating the states, and the states point to it.
+ */
+typedef struct MedianTypeDesc
 {
 	Oid			arg_type;
 	bool		arg_typbyval;
 	int16		arg_typlen;
+	char		arg_typalign;
+
+	/* Representation of the accumulated values */
+	MedianValuesKind values_kind;
+
+	/* Ordering operator and comparison function of the type */
+	Oid			lt_opr;
+	FmgrInfo	cmp_finfo;
+
+	/*
+	 * Send and receive functions, looked up once a state is serialized or
+	 * deserialized, in the memory context of the descriptor
+	 */
+	FmgrInfo	send_finfo;
+	FmgrInfo	recv_finfo;
 	Oid			arg_typioparam;
+	MemoryContext context;
+}	MedianTypeDesc;
 
-	/* Various routines */
-	Oid			cmp_proc;
-	Oid			send_proc;
-	Oid			recv_proc;
+/* Internal state used by median aggregate function */
+typedef struct MedianState
+{
+	MedianTypeDesc *type;
 
-	/* Array of accumulated Datums */
-	Datum	   *values;
+	/* Collation of the aggregate, used to sort values of a partial state */
+	Oid			collation;
+	/* Aggregate memory context the state is allocated in */
+	MemoryContext agg_context;
+
+	/* Array of accumulated values, the member used depends on values_kind */
+	union
+	{
+		void	   *ptr;
+		Datum	   *datums;
+		int64	   *ints;
+		float8	   *floats;
+	}			values;
 	/* Number of rows in the array values */
 	uint32		values_num;
 	/* Allocated length of the array values */
 	uint32		values_alloc;
+	/* Total size of the by-reference values referenced by the array values */
+	Size		values_bytes;
+
+	/*
+	 * Chunks holding the by-reference values, the first one is the current
+	 * chunk.  They are allocated in the aggregate memory context and go away
+	 * together with it.
+	 */
+	MedianArenaChunk *arena;
+	/* Used size of the current chunk */
+	Size		arena_used;
+
+	/*
+	 * The leading values of the array values may form sorted runs, merged
+	 * from sorted partial states.  Run i ends right before run_ends[i] and
+	 * starts where the previous run ends.  Values after the last run aren't
+	 * sorted.
+	 */
+	uint32	   *run_ends;
+	int			runs_num;
+	int			runs_alloc;
+
+	/*
+	 * Number of values each value of the array values stands for, NULL if
+	 * each stands for itself only.  Weighted input values have their weights
+	 * here, and consecutive equal input values are stored once, along with
+	 * the number of their repetitions.
+	 */
+	uint64	   *weights;
+	/* Total weight of all the values of a weighted state */
+	uint64		weights_total;
+	/* Input values equal to the preceding one, while weights is NULL */
+	uint32		values_repeats;
+
+	/*
+	 * Values moved out of the array values into a temporary file, once the
+	 * state exceeded work_mem
+	 */
+	BufFile    *spill_file;
+	/* Weights of the values in the temporary file, in the same order */
+	BufFile    *spill_weights;
+	/* Number of values in the temporary file */
+	uint64		spill_num;
+	/* Total size of the by-reference values in the temporary file */
+	uint64		spill_bytes;
+
+	/*
+	 * Reservoir sample of the values in the temporary file, taken as they
+	 * are spilled, so that the final function picks its first pivots without
+	 * reading the file.  By-reference values are copied into the aggregate
+	 * memory context.  Once the sample is full, the values replacing its
+	 * values are picked by skipping over the others, as in Li's algorithm L:
+	 * spill_sample_next is the position of the next one among the spilled
+	 * values and spill_sample_w the current largest key of the sample.
+	 */
+	Datum	   *spill_sample;
+	uint32		spill_sample_num;
+	uint32		spill_sample_alloc;
+	uint64		spill_sample_seed;
+	uint64		spill_sample_next;
+	double		spill_sample_w;
+
+	/*
+	 * Hash table counting occurrences of distinct values, used instead of
+	 * the array values and the temporary file for low-cardinality integer
+	 * values.  Its allocated length is a power of two.
+	 */
+	MedianCountsEntry *counts;
+	uint32		counts_alloc;
+	/* Number of distinct values in the hash table */
+	uint32		counts_num;
+	/* Total number of values counted by the hash table */
+	uint64		counts_total;
+
+	/*
+	 * Fractions requested by percentiles(), -1 stands for a NULL fraction.
+	 * NULL for median() and until the fractions are known.
+	 */
+	float8	   *fractions;
+	int			fractions_num;
+	/* Dimensions of the fractions array followed by its lower bounds */
+	int		   *fractions_bounds;
+	int			fractions_ndim;
+
+	/*
+	 * Set for states made by the deserialize function.  They are allocated
+	 * in the aggregate memory context and aren't used after being combined,
+	 * so the combine function may take their memory over.
+	 */
+	bool		deserialized;
+
+	/* Statistics of the state, NULL unless median.track_stats is on */
+	MedianStats *stats;
+
+	/*
+	 * The first values are kept in the state itself, the array values points
+	 * here until it outgrows it.  The many small states of a GROUP BY then
+	 * take a single allocation each.
+	 */
+	Datum		values_inline[MEDIAN_INLINE_VALUES];
 }	MedianState;
 
-/* Values sorting internal context */
-typedef struct MedianSortContext
-{
-	Oid			collation;
-	FmgrInfo	cmp_finfo;
-}	MedianSortContext;
+/* Largest number of values the array values can hold */
+#define MEDIAN_MAX_VALUES	(MaxAllocSize / sizeof(Datum))
+
+/* Maximum number of pivots a pass of the external selection splits with */
+#define SPILL_NUM_PIVOTS	1023
+/* Size of the samples the pivots are picked from */
+#define SPILL_SAMPLE_SIZE	(32 * (SPILL_NUM_PIVOTS + 1))
+
+/* Sequential scan over the values of a state, spilled ones come first */
+typedef struct MedianValuesScan
+{
+	MedianState *state;
+	/* Number of values returned so far */
+	uint64		pos;
+	/* Buffer holding the last by-reference value read from the file */
+	char	   *buf;
+	Size		buf_size;
+}	MedianValuesScan;
+
+/* Values selection internal context */
+typedef struct MedianSortContext
+{
+	Oid			collation;
+	FmgrInfo	cmp_finfo;
+}	MedianSortContext;
+
+/*
+ * Datum of the values array along with its abbreviated key, used to select
+ * and sort values of MEDIAN_VALUES_DATUM kind.  The key is the value itself
+ * if the type doesn't support abbreviation.
+ */
+typedef struct MedianSortItem
+{
+	Datum		key;
+	Datum		value;
+}	MedianSortItem;
+
+/*
+ * Values of a weighted state along with their weights, used to select among
+ * them in memory.
+ */
+typedef struct MedianWeightedInt64
+{
+	int64		value;
+	uint64		weight;
+}	MedianWeightedInt64;
+
+typedef struct MedianWeightedFloat8
+{
+	float8		value;
+	uint64		weight;
+}	MedianWeightedFloat8;
+
+typedef struct MedianWeightedItem
+{
+	MedianSortItem item;
+	uint64		weight;
+}	MedianWeightedItem;
+
+/*
+ * Type information used to compare and copy datums of the argument type, by
+ * the states that keep values as datums regardless of their representation
+ * kind.
+ */
+typedef struct MedianTypeInfo
+{
+	Oid			arg_type;
+	bool		arg_typbyval;
+	int16		arg_typlen;
+	MedianValuesKind values_kind;
+
+	/* Used to compare values of MEDIAN_VALUES_DATUM kind */
+	MedianSortContext ctx;
+}	MedianTypeInfo;
+
+/* Method used to compute the mean of two middle elements */
+typedef enum MedianMeanMethod
+{
+	MEDIAN_MEAN_INT64,			/* native integer arithmetic */
+	MEDIAN_MEAN_FLOAT8,			/* native float arithmetic */
+	MEDIAN_MEAN_NUMERIC,		/* numeric arithmetic */
+	MEDIAN_MEAN_OPERATORS		/* plus and division operators of the type */
+}	MedianMeanMethod;
+
+/*
+ * Routines used to compute the mean, cached in fn_extra of the final function
+ */
+typedef struct MedianMeanCache
+{
+	Oid			arg_type;
+	MedianMeanMethod method;
+
+	/* Used only by MEDIAN_MEAN_OPERATORS */
+	FmgrInfo	plus_finfo;
+	FmgrInfo	div_finfo;
+	/* The divisor, used by MEDIAN_MEAN_NUMERIC and MEDIAN_MEAN_OPERATORS */
+	Datum		two;
+	/* Numeric halves used by median_cont(), for MEDIAN_MEAN_INT64 and NUMERIC */
+	Datum		half;
+	Datum		minus_half;
+}	MedianMeanCache;
+
+static void counts_append(MedianState * state, Datum val, uint64 weight,
+						  MemoryContext agg_context);
+static void counts_try_begin(MedianState * state, MemoryContext agg_context);
+static void values_spill_select(MedianState * state, Oid collation,
+								uint64 rank, Datum *val, Datum *next);
+static void values_runs_select(MedianState * state, Oid collation,
+							   uint64 rank, Datum *val, Datum *next);
+
+/*
+ * Choose the representation of accumulated values of the given type.
+ */
+static MedianValuesKind
+values_kind_for_type(Oid arg_type)
+{
+	switch (getBaseType(arg_type))
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case DATEOID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			return MEDIAN_VALUES_INT64;
+		case FLOAT4OID:
+		case FLOAT8OID:
+			return MEDIAN_VALUES_FLOAT8;
+		default:
+			return MEDIAN_VALUES_DATUM;
+	}
+}
+
+/*
+ * Convert the datum into a native integer.  The width of the integer is
+ * determined by the type's length.
+ */
+static inline int64
+datum_get_int64(int16 typlen, Datum val)
+{
+	switch (typlen)
+	{
+		case sizeof(int16):
+			return DatumGetInt16(val);
+		case sizeof(int32):
+			return DatumGetInt32(val);
+		default:
+			return DatumGetInt64(val);
+	}
+}
+
+/*
+ * Convert the native integer back into a datum of a type of the given length.
+ */
+static inline Datum
+int64_get_datum(int16 typlen, int64 val)
+{
+	switch (typlen)
+	{
+		case sizeof(int16):
+			return Int16GetDatum((int16) val);
+		case sizeof(int32):
+			return Int32GetDatum((int32) val);
+		default:
+			return Int64GetDatum(val);
+	}
+}
+
+/*
+ * Convert the datum into a native float.  The width of the float is
+ * determined by the type's length.
+ */
+static inline float8
+datum_get_float8(int16 typlen, Datum val)
+{
+	if (typlen == sizeof(float4))
+		return DatumGetFloat4(val);
+	return DatumGetFloat8(val);
+}
+
+/*
+ * Convert the native float back into a datum of a type of the given length.
+ */
+static inline Datum
+float8_get_datum(int16 typlen, float8 val)
+{
+	if (typlen == sizeof(float4))
+		return Float4GetDatum((float4) val);
+	return Float8GetDatum(val);
+}
+
+/*
+ * Get the i-th accumulated value as a datum of the state's type.
+ */
+static Datum
+values_get_datum(MedianState * state, uint32 i)
+{
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			return int64_get_datum(state->type->arg_typlen,
+								   state->values.ints[i]);
+		case MEDIAN_VALUES_FLOAT8:
+			return float8_get_datum(state->type->arg_typlen,
+									state->values.floats[i]);
+		default:
+			return state->values.datums[i];
+	}
+}
+
+/*
+ * Allocate memory for a by-reference value of the state.  New chunks are
+ * allocated in the current memory context.
+ */
+static char *
+arena_alloc(MedianState * state, Size size)
+{
+	MedianArenaChunk *chunk = state->arena;
+	char	   *ptr;
+
+	size = MAXALIGN(size);
+
+	if (chunk != NULL && state->arena_used + size <= chunk->size)
+	{
+		ptr = (char *) chunk + ARENA_CHUNK_HEADER + state->arena_used;
+		state->arena_used += size;
+		return ptr;
+	}
+
+	if (size > ARENA_LARGE_VALUE)
+	{
+		/*
+		 * A large value gets a chunk of its own, linked behind the current
+		 * one, so that the rest of the current chunk is still used
+		 */
+		MedianArenaChunk *large;
+
+		large = (MedianArenaChunk *) palloc(ARENA_CHUNK_HEADER + size);
+		large->size = size;
+
+		if (chunk != NULL)
+		{
+			large->next = chunk->next;
+			chunk->next = large;
+		}
+		else
+		{
+			large->next = NULL;
+			state->arena = large;
+			state->arena_used = size;
+		}
+
+		return (char *) large + ARENA_CHUNK_HEADER;
+	}
+	else
+	{
+		Size		chunk_size;
+
+		chunk_size = chunk != NULL ?
+			Min(chunk->size * 2, ARENA_MAX_CHUNK) : ARENA_MIN_CHUNK;
+
+		chunk = (MedianArenaChunk *) palloc(ARENA_CHUNK_HEADER + chunk_size);
+		chunk->size = chunk_size;
+		chunk->next = state->arena;
+		state->arena = chunk;
+		state->arena_used = size;
+
+		return (char *) chunk + ARENA_CHUNK_HEADER;
+	}
+}
+
+/*
+ * Free all the chunks of the state but the current one, which is reused.
+ */
+static void
+arena_reset(MedianState * state)
+{
+	MedianArenaChunk *chunk;
+
+	if (state->arena == NULL)
+		return;
+
+	chunk = state->arena->next;
+	while (chunk != NULL)
+	{
+		MedianArenaChunk *next = chunk->next;
+
+		pfree(chunk);
+		chunk = next;
+	}
+
+	state->arena->next = NULL;
+	state->arena_used = 0;
+}
+
+/*
+ * Take over the chunks of the source state.  They are linked behind the
+ * current chunk of the destination.
+ */
+static void
+arena_adopt(MedianState * source, MedianState * dest)
+{
+	MedianArenaChunk *tail;
+
+	if (source->arena == NULL)
+		return;
+
+	if (dest->arena == NULL)
+	{
+		dest->arena = source->arena;
+		dest->arena_used = source->arena_used;
+	}
+	else
+	{
+		for (tail = source->arena; tail->next != NULL; tail = tail->next)
+			;
+		tail->next = dest->arena->next;
+		dest->arena->next = source->arena;
+	}
+
+	source->arena = NULL;
+}
+
+/*
+ * Copy a by-reference value into the chunks of the state.
+ */
+static Datum
+values_copy_datum(MedianState * state, Datum val)
+{
+	Size		size;
+	char	   *ptr;
+
+	Assert(!state->type->arg_typbyval);
+
+	size = datumGetSize(val, state->type->arg_typbyval,
+						 state->type->arg_typlen);
+	ptr = arena_alloc(state, size);
+	memcpy(ptr, DatumGetPointer(val), size);
+	state->values_bytes += MAXALIGN(size);
+
+	return PointerGetDatum(ptr);
+}
+
+/*
+ * Write to the temporary file of a state.
+ */
+static void
+spill_write(BufFile *file, void *ptr, size_t size)
+{
+#if PG_VERSION_NUM >= 160000
+	BufFileWrite(file, ptr, size);
+#else
+	if (BufFileWrite(file, ptr, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write to median temporary file: %m")));
+#endif
+}
+
+/*
+ * Read from the temporary file of a state.
+ */
+static void
+spill_read(BufFile *file, void *ptr, size_t size)
+{
+#if PG_VERSION_NUM >= 160000
+	BufFileReadExact(file, ptr, size);
+#else
+	if (BufFileRead(file, ptr, size) != size)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read from median temporary file: %m")));
+#endif
+}
+
+static void
+spill_seek(BufFile *file, int whence)
+{
+	if (BufFileSeek(file, 0, 0L, whence) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not seek in median temporary file: %m")));
+}
+
+/*
+ * Weight of the i-th value of the values array.
+ */
+static inline uint64
+values_weight(MedianState * state, uint32 i)
+{
+	return state->weights != NULL ? state->weights[i] : 1;
+}
+
+/*
+ * Number of values of all kinds the state stands for.
+ */
+static inline uint64
+values_total(MedianState * state)
+{
+	if (state->weights != NULL)
+		return state->weights_total;
+	return state->counts_total + state->spill_num + state->values_num;
+}
+
+/*
+ * Check whether the values array is the one kept in the state itself.
+ */
+static inline bool
+values_is_inline(MedianState * state)
+{
+	return state->values.ptr == (void *) state->values_inline;
+}
+
+/*
+ * Memory context the values array is allocated in, which is the context of
+ * the state itself while the array is kept there.
+ */
+static inline MemoryContext
+values_context(MedianState * state)
+{
+	if (values_is_inline(state))
+		return GetMemoryChunkContext(state);
+	return GetMemoryChunkContext(state->values.ptr);
+}
+
+/*
+ * Make the values of the state weighted, each of the values accumulated so
+ * far stands for itself only.  The weights are allocated in the memory
+ * context of the values array.
+ */
+static void
+values_make_weighted(MedianState * state)
+{
+	MemoryContext context = values_context(state);
+	uint64		one = 1;
+
+	Assert(state->weights == NULL && state->counts == NULL);
+
+	state->weights = MemoryContextAlloc(context, Max(state->values_alloc, 1) *
+										sizeof(uint64));
+	for (uint32 i = 0; i < state->values_num; i++)
+		state->weights[i] = 1;
+	state->weights_total = state->spill_num + state->values_num;
+
+	if (state->spill_num > 0)
+	{
+		MemoryContext old_context = MemoryContextSwitchTo(context);
+
+		state->spill_weights = BufFileCreateTemp(false);
+		for (uint64 i = 0; i < state->spill_num; i++)
+			spill_write(state->spill_weights, &one, sizeof(one));
+
+		MemoryContextSwitchTo(old_context);
+	}
+}
+
+/*
+ * Largest allocated length of the values array which doesn't exceed work_mem
+ * before the array is full.  Native values then only need to be checked
+ * against work_mem once the array is full.
+ */
+static inline uint32
+values_max_alloc(MedianState * state)
+{
+	Size		value_size = MEDIAN_VALUE_SIZE(state) +
+		(state->weights != NULL ? sizeof(uint64) : 0);
+
+	return Min((Size) work_mem * 1024L / value_size + 1, MEDIAN_MAX_VALUES);
+}
+
+/*
+ * Reallocate the values array with the given length, which has to be at
+ * least values_num.  The values kept in the state itself move out of it into
+ * an allocated array once they don't fit there.  The weights are left to the
+ * caller.
+ */
+static void
+values_resize(MedianState * state, uint32 alloc)
+{
+	Size		value_size = MEDIAN_VALUE_SIZE(state);
+
+	Assert(alloc >= state->values_num && alloc > 0);
+
+	if (state->stats != NULL)
+		state->stats->resizes++;
+
+	if (!values_is_inline(state))
+		state->values.ptr = repalloc(state->values.ptr, alloc * value_size);
+	else if (alloc > MEDIAN_INLINE_VALUES)
+	{
+		state->values.ptr = MemoryContextAlloc(values_context(state),
+											   alloc * value_size);
+		memcpy(state->values.ptr, state->values_inline,
+			   state->values_num * value_size);
+	}
+	else
+		alloc = MEDIAN_INLINE_VALUES;
+
+	state->values_alloc = alloc;
+}
+
+/*
+ * Enlarge the full values array geometrically, up to values_max_alloc().
+ */
+static void
+values_grow(MedianState * state)
+{
+	uint32		alloc = Min(state->values_alloc * 2, values_max_alloc(state));
+
+	values_resize(state, Max(alloc, state->values_num + 1));
+	if (state->weights != NULL)
+		state->weights = repalloc(state->weights,
+								  state->values_alloc * sizeof(uint64));
+}
+
+/*
+ * Make room for num more values, for combining states.  The array grows at
+ * least geometrically, so that combining the partial states of many workers
+ * one after another doesn't reallocate it for each of them.
+ */
+static void
+values_reserve(MedianState * state, uint32 num)
+{
+	uint32		needed = state->values_num + num;
+
+	if (needed <= state->values_alloc)
+		return;
+
+	values_resize(state, Max(needed, Min(state->values_alloc * 2,
+										 values_max_alloc(state))));
+	if (state->weights != NULL)
+		state->weights = repalloc(state->weights,
+								  state->values_alloc * sizeof(uint64));
+}
+
+/*
+ * Give back the unused part of the values array, once it is at least as
+ * large as the used one.  The array of a combined state doesn't grow much
+ * more, so its slack would stay unused.
+ */
+static void
+values_trim(MedianState * state)
+{
+	if (values_is_inline(state) ||
+		state->values_alloc - state->values_num < state->values_num)
+		return;
+
+	values_resize(state, Max(state->values_num, 1));
+	if (state->weights != NULL)
+		state->weights = repalloc(state->weights,
+								  state->values_alloc * sizeof(uint64));
+}
+
+/*
+ * Append a copy of the value, standing for weight values, to the values
+ * array.  By-reference values are copied into the current memory context.
+ */
+static void
+values_append(MedianState * state, Datum val, uint64 weight)
+{
+	if (weight != 1 && state->weights == NULL)
+		values_make_weighted(state);
+
+	if (state->values_num >= state->values_alloc)
+		values_grow(state);
+
+	if (state->weights != NULL)
+	{
+		state->weights[state->values_num] = weight;
+		state->weights_total += weight;
+	}
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			state->values.ints[state->values_num] =
+				datum_get_int64(state->type->arg_typlen, val);
+			break;
+		case MEDIAN_VALUES_FLOAT8:
+			state->values.floats[state->values_num] =
+				datum_get_float8(state->type->arg_typlen, val);
+			break;
+		default:
+			if (state->type->arg_typbyval)
+				state->values.datums[state->values_num] = val;
+			/*
+			 * Detoast the argument if it's varlena, so that compressed or
+			 * out-of-line values are stored expanded and no comparison has
+			 * to detoast them again
+			 */
+			else if (state->type->arg_typlen == -1)
+			{
+				struct varlena *detoasted = PG_DETOAST_DATUM(val);
+
+				state->values.datums[state->values_num] =
+					values_copy_datum(state, PointerGetDatum(detoasted));
+				if ((Pointer) detoasted != DatumGetPointer(val))
+					pfree(detoasted);
+			}
+			else
+				state->values.datums[state->values_num] =
+					values_copy_datum(state, val);
+			break;
+	}
+
+	state->values_num++;
+}
+
+/*
+ * Check whether the value is equal to the i-th value of the values array,
+ * byte by byte, so that they can be stored once along with their number.
+ */
+static inline bool
+values_equal(MedianState * state, uint32 i, Datum val)
+{
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			return state->values.ints[i] ==
+				datum_get_int64(state->type->arg_typlen, val);
+		case MEDIAN_VALUES_FLOAT8:
+			{
+				float8		fval = datum_get_float8(state->type->arg_typlen,
+													val);
+
+				return memcmp(&state->values.floats[i], &fval,
+							  sizeof(fval)) == 0;
+			}
+		default:
+			return datumIsEqual(state->values.datums[i], val,
+								state->type->arg_typbyval,
+								state->type->arg_typlen);
+	}
+}
+
+/*
+ * Store consecutive equal values of the values array once, along with the
+ * number of their repetitions.  This makes the values weighted.
+ */
+static void
+values_compress(MedianState * state)
+{
+	uint32		num = 0;
+
+	if (state->weights == NULL)
+		values_make_weighted(state);
+
+	for (uint32 i = 0; i < state->values_num; i++)
+	{
+		uint64		weight = state->weights[i];
+
+		if (num > 0 && values_equal(state, num - 1, values_get_datum(state, i)))
+		{
+			state->weights[num - 1] += weight;
+			continue;
+		}
+
+		switch (state->type->values_kind)
+		{
+			case MEDIAN_VALUES_INT64:
+				state->values.ints[num] = state->values.ints[i];
+				break;
+			case MEDIAN_VALUES_FLOAT8:
+				state->values.floats[num] = state->values.floats[i];
+				break;
+			default:
+				state->values.datums[num] = state->values.datums[i];
+				break;
+		}
+		state->weights[num++] = weight;
+	}
+
+	state->values_num = num;
+	state->values_repeats = 0;
+
+	/* The values moved, so the sorted runs no longer end where they did */
+	state->runs_num = 0;
+}
+
+/*
+ * Number of the leading values of the array values which form sorted runs.
+ */
+static inline uint32
+values_sorted_num(MedianState * state)
+{
+	return state->runs_num > 0 ? state->run_ends[state->runs_num - 1] : 0;
+}
+
+/*
+ * Check whether the values array consists of sorted runs only, which are then
+ * searched by values_runs_select().
+ */
+static inline bool
+values_all_sorted(MedianState * state)
+{
+	return state->runs_num > 0 && state->spill_file == NULL &&
+		values_sorted_num(state) == state->values_num;
+}
+
+/*
+ * Mark the values from the end of the last run up to the given position as a
+ * sorted run.
+ */
+static void
+values_add_run(MedianState * state, uint32 end, MemoryContext context)
+{
+	if (state->runs_num >= state->runs_alloc)
+	{
+		state->runs_alloc = Max(state->runs_alloc * 2, 8);
+		if (state->run_ends == NULL)
+			state->run_ends = MemoryContextAlloc(context, state->runs_alloc *
+												 sizeof(uint32));
+		else
+			state->run_ends = repalloc(state->run_ends, state->runs_alloc *
+									   sizeof(uint32));
+	}
+
+	state->run_ends[state->runs_num++] = end;
+}
+
+/*
+ * Check whether the values array should be moved into the temporary file.
+ */
+static inline bool
+values_exceed_work_mem(MedianState * state)
+{
+	Size		value_size = MEDIAN_VALUE_SIZE(state) +
+		(state->weights != NULL ? sizeof(uint64) : 0);
+
+	return (Size) state->values_num * value_size +
+		state->values_bytes > (Size) work_mem * 1024L ||
+		state->values_num >= MEDIAN_MAX_VALUES;
+}
+
+/*
+ * Close the temporary files of a state when the aggregate memory context
+ * goes away.
+ */
+static void
+spill_cleanup(void *arg)
+{
+	MedianState *state = (MedianState *) arg;
+
+	/*
+	 * On abort the resource owner has already closed the files by the time
+	 * the memory is released, so they mustn't be closed twice.
+	 */
+	if (IsTransactionState())
+	{
+		if (state->spill_file != NULL)
+			BufFileClose(state->spill_file);
+		if (state->spill_weights != NULL)
+			BufFileClose(state->spill_weights);
+	}
+	state->spill_file = NULL;
+	state->spill_weights = NULL;
+}
+
+/*
+ * Next number of a xorshift64 sequence, used for the samples of the values.
+ */
+static inline uint64
+spill_random(uint64 *seed)
+{
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 7;
+	*seed ^= *seed << 17;
+	return *seed;
+}
+
+/*
+ * Next number of a uniform distribution over (0, 1).
+ */
+static inline double
+spill_random_fraction(uint64 *seed)
+{
+	return ((spill_random(seed) >> 11) + 0.5) / (double) (UINT64CONST(1) << 53);
+}
+
+/*
+ * Move spill_sample_next to the position of the next spilled value to enter
+ * the full sample.
+ */
+static inline void
+spill_sample_skip(MedianState * state)
+{
+	uint64	   *seed = &state->spill_sample_seed;
+
+	state->spill_sample_w *= exp(log(spill_random_fraction(seed)) /
+								 state->spill_sample_alloc);
+	state->spill_sample_next +=
+		(uint64) floor(log(spill_random_fraction(seed)) /
+					   log(1 - state->spill_sample_w)) + 1;
+}
+
+/*
+ * Add the values of the values array, which are about to be spilled, to the
+ * reservoir sample of the spilled values.  The sample is allocated on the
+ * first spill, with room for up to SPILL_SAMPLE_SIZE values taking about a
+ * sixteenth of work_mem at most.
+ */
+static void
+spill_sample_add(MedianState * state, MemoryContext agg_context)
+{
+	MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+	uint64		end = state->spill_num + state->values_num;
+
+	if (state->spill_sample == NULL)
+	{
+		Size		avg_size = MEDIAN_VALUE_SIZE(state) +
+			state->values_bytes / Max(state->values_num, 1);
+
+		state->spill_sample_alloc = Min(SPILL_SAMPLE_SIZE,
+										Max((Size) work_mem * 1024L / 16 / avg_size,
+											SPILL_NUM_PIVOTS + 1));
+		state->spill_sample = palloc(state->spill_sample_alloc * sizeof(Datum));
+	}
+
+	/* Fill the sample, then replace its values at the picked positions */
+	while (state->spill_sample_num < state->spill_sample_alloc ?
+		   state->spill_sample_num < end : state->spill_sample_next < end)
+	{
+		uint32		i;
+		uint32		j;
+
+		if (state->spill_sample_num < state->spill_sample_alloc)
+		{
+			i = state->spill_sample_num - state->spill_num;
+			j = state->spill_sample_num++;
+
+			if (state->spill_sample_num == state->spill_sample_alloc)
+			{
+				state->spill_sample_w = 1;
+				state->spill_sample_next = state->spill_sample_num - 1;
+				spill_sample_skip(state);
+			}
+		}
+		else
+		{
+			i = state->spill_sample_next - state->spill_num;
+			j = spill_random(&state->spill_sample_seed) %
+				state->spill_sample_alloc;
+			if (!state->type->arg_typbyval)
+				pfree(DatumGetPointer(state->spill_sample[j]));
+			spill_sample_skip(state);
+		}
+
+		if (state->type->values_kind != MEDIAN_VALUES_DATUM ||
+			state->type->arg_typbyval)
+			state->spill_sample[j] = values_get_datum(state, i);
+		else
+			state->spill_sample[j] = datumCopy(state->values.datums[i], false,
+											   state->type->arg_typlen);
+	}
+
+	MemoryContextSwitchTo(old_context);
+}
+
+/*
+ * Move the values array into the temporary file of the state, so that the
+ * memory used by the state stays within work_mem.
+ *
+ * Native values are written as they are.  Datums of by-value types are
+ * written as Datums, by-reference ones are preceded by their size.  Weights
+ * are written into a file of their own.
+ */
+static void
+values_spill(MedianState * state, MemoryContext agg_context)
+{
+	if (state->spill_file == NULL)
+	{
+		MemoryContext old_context;
+		MemoryContextCallback *callback;
+
+		old_context = MemoryContextSwitchTo(agg_context);
+
+		state->spill_file = BufFileCreateTemp(false);
+
+		callback = (MemoryContextCallback *) palloc(sizeof(MemoryContextCallback));
+		callback->func = spill_cleanup;
+		callback->arg = state;
+		MemoryContextRegisterResetCallback(agg_context, callback);
+
+		MemoryContextSwitchTo(old_context);
+	}
+	else
+	{
+		/* The final function might have read the file since the last call */
+		spill_seek(state->spill_file, SEEK_END);
+	}
+
+	spill_sample_add(state, agg_context);
+	if (state->stats != NULL)
+		state->stats->spills++;
+
+	if (state->type->values_kind != MEDIAN_VALUES_DATUM)
+		spill_write(state->spill_file, state->values.ptr,
+					state->values_num * MEDIAN_VALUE_SIZE(state));
+	else if (state->type->arg_typbyval)
+		spill_write(state->spill_file, state->values.datums,
+					state->values_num * sizeof(Datum));
+	else
+	{
+		for (uint32 i = 0; i < state->values_num; i++)
+		{
+			Pointer		ptr = DatumGetPointer(state->values.datums[i]);
+			uint32		len = datumGetSize(state->values.datums[i],
+										   state->type->arg_typbyval,
+										   state->type->arg_typlen);
+
+			spill_write(state->spill_file, &len, sizeof(len));
+			spill_write(state->spill_file, ptr, len);
+		}
+
+		arena_reset(state);
+	}
+
+	if (state->weights != NULL)
+	{
+		if (state->spill_weights == NULL)
+		{
+			MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+
+			state->spill_weights = BufFileCreateTemp(false);
+			MemoryContextSwitchTo(old_context);
+		}
+		else
+			spill_seek(state->spill_weights, SEEK_END);
+
+		spill_write(state->spill_weights, state->weights,
+					state->values_num * sizeof(uint64));
+	}
+
+	state->spill_num += state->values_num;
+	state->spill_bytes += state->values_bytes;
+	state->values_num = 0;
+	state->values_bytes = 0;
+	state->values_repeats = 0;
+	state->runs_num = 0;
+}
+
+/*
+ * Start a scan over all the values of a state.
+ */
+static void
+values_scan_begin(MedianValuesScan * scan, MedianState * state)
+{
+	scan->state = state;
+	scan->pos = 0;
+	scan->buf = NULL;
+	scan->buf_size = 0;
+
+	if (state->spill_file != NULL)
+		spill_seek(state->spill_file, SEEK_SET);
+	if (state->spill_weights != NULL)
+		spill_seek(state->spill_weights, SEEK_SET);
+}
+
+/*
+ * Fetch the next value of the scan and its weight, returns false once all the
+ * values were returned.  A by-reference value read from the temporary file is
+ * only valid until the next call.
+ */
+static bool
+values_scan_next(MedianValuesScan * scan, Datum *val, uint64 *weight)
+{
+	MedianState *state = scan->state;
+
+	if (scan->pos >= state->spill_num)
+	{
+		uint64		i = scan->pos - state->spill_num;
+
+		if (i >= state->values_num)
+			return false;
+
+		*val = values_get_datum(state, (uint32) i);
+		*weight = values_weight(state, (uint32) i);
+		scan->pos++;
+		return true;
+	}
+
+	if (state->weights != NULL)
+		spill_read(state->spill_weights, weight, sizeof(uint64));
+	else
+		*weight = 1;
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			{
+				int64		ival;
+
+				spill_read(state->spill_file, &ival, sizeof(ival));
+				*val = int64_get_datum(state->type->arg_typlen, ival);
+				break;
+			}
+		case MEDIAN_VALUES_FLOAT8:
+			{
+				float8		fval;
+
+				spill_read(state->spill_file, &fval, sizeof(fval));
+				*val = float8_get_datum(state->type->arg_typlen, fval);
+				break;
+			}
+		default:
+			if (state->type->arg_typbyval)
+				spill_read(state->spill_file, val, sizeof(Datum));
+			else
+			{
+				uint32		len;
+
+				spill_read(state->spill_file, &len, sizeof(len));
+				if (len > scan->buf_size)
+				{
+					if (scan->buf != NULL)
+						pfree(scan->buf);
+					scan->buf_size = Max(len, 1024);
+					scan->buf = palloc(scan->buf_size);
+				}
+				spill_read(state->spill_file, scan->buf, len);
+				*val = PointerGetDatum(scan->buf);
+			}
+			break;
+	}
+
+	scan->pos++;
+	return true;
+}
+
+/*
+ * Release the resources of the scan.
+ */
+static void
+values_scan_end(MedianValuesScan * scan)
+{
+	if (scan->buf != NULL)
+		pfree(scan->buf);
+}
+
+/*
+ * Check whether the values array reached the size at which it's checked for
+ * low cardinality and repetitions, which happens each time it doubles.
+ */
+static inline bool
+values_checkpoint(MedianState * state)
+{
+	return state->values_num >= COUNTS_CHECK_MIN &&
+		(state->values_num & (state->values_num - 1)) == 0;
+}
+
+/*
+ * Compress the runs of equal values of the values array, if that at least
+ * halves the memory the array takes.
+ */
+static void
+values_try_compress(MedianState * state)
+{
+	Size		value_size = MEDIAN_VALUE_SIZE(state);
+
+	if (state->weights == NULL &&
+		(Size) (state->values_num - state->values_repeats) *
+		(value_size + sizeof(uint64)) * 2 <=
+		(Size) state->values_num * value_size)
+		values_compress(state);
+}
+
+/*
+ * Initialize the descriptor of the given argument type.  The comparison
+ * function is set up in the given memory context, the send and receive
+ * functions only once they are needed.
+ */
+static void
+typedesc_init(MedianTypeDesc * desc, Oid arg_type, MemoryContext context)
+{
+	TypeCacheEntry *typentry;
+
+	desc->arg_type = arg_type;
+	get_typlenbyvalalign(arg_type, &desc->arg_typlen, &desc->arg_typbyval,
+						 &desc->arg_typalign);
+	desc->values_kind = values_kind_for_type(arg_type);
+
+	typentry = lookup_type_cache(arg_type,
+								 TYPECACHE_CMP_PROC | TYPECACHE_LT_OPR);
+	if (!OidIsValid(typentry->cmp_proc))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+		   errmsg("could not identify a comparison function for type %s",
+				  format_type_be(arg_type))));
+	desc->lt_opr = typentry->lt_opr;
+	fmgr_info_cxt(typentry->cmp_proc, &desc->cmp_finfo, context);
+
+	desc->send_finfo.fn_oid = InvalidOid;
+	desc->recv_finfo.fn_oid = InvalidOid;
+	desc->arg_typioparam = InvalidOid;
+	desc->context = context;
+}
+
+/*
+ * Get the descriptor of the given argument type, cached in fn_extra of the
+ * function.  If the cached descriptor is of another type, it's replaced but
+ * not freed, as the states made before may still point to it.  Without the
+ * function the descriptor is made in the current memory context.
+ */
+static MedianTypeDesc *
+typedesc_get(FmgrInfo *flinfo, Oid arg_type)
+{
+	MedianTypeDesc *desc;
+
+	if (flinfo == NULL)
+	{
+		desc = (MedianTypeDesc *) palloc(sizeof(MedianTypeDesc));
+		typedesc_init(desc, arg_type, CurrentMemoryContext);
+		return desc;
+	}
+
+	desc = (MedianTypeDesc *) flinfo->fn_extra;
+	if (desc != NULL && desc->arg_type == arg_type)
+		return desc;
+
+	desc = (MedianTypeDesc *) MemoryContextAlloc(flinfo->fn_mcxt,
+												 sizeof(MedianTypeDesc));
+	typedesc_init(desc, arg_type, flinfo->fn_mcxt);
+	flinfo->fn_extra = desc;
+
+	return desc;
+}
+
+/*
+ * Send function of the type, looked up on the first call.
+ */
+static FmgrInfo *
+typedesc_send_finfo(MedianTypeDesc * desc)
+{
+	if (!OidIsValid(desc->send_finfo.fn_oid))
+	{
+		Oid			send_proc;
+		bool		typisvarlena;
+
+		getTypeBinaryOutputInfo(desc->arg_type, &send_proc, &typisvarlena);
+		fmgr_info_cxt(send_proc, &desc->send_finfo, desc->context);
+	}
+
+	return &desc->send_finfo;
+}
+
+/*
+ * Receive function of the type, looked up on the first call.
+ */
+static FmgrInfo *
+typedesc_recv_finfo(MedianTypeDesc * desc)
+{
+	if (!OidIsValid(desc->recv_finfo.fn_oid))
+	{
+		Oid			recv_proc;
+
+		getTypeBinaryInputInfo(desc->arg_type, &recv_proc,
+							   &desc->arg_typioparam);
+		fmgr_info_cxt(recv_proc, &desc->recv_finfo, desc->context);
+	}
+
+	return &desc->recv_finfo;
+}
+
+/*
+ * Create the transition state for the argument type of the aggregate.
+ */
+static MedianState *
+median_state_create(FunctionCallInfo fcinfo, MemoryContext agg_context)
+{
+	MedianState *state;
+	MemoryContext old_context;
+	Oid			arg_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+	if (!OidIsValid(arg_type))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("could not determine input data type")));
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	state = (MedianState *) palloc(sizeof(MedianState));
+	state->type = typedesc_get(fcinfo->flinfo, arg_type);
+	state->collation = PG_GET_COLLATION();
+
+	/* Initialize the values array */
+	state->agg_context = agg_context;
+	state->values_alloc = MEDIAN_INLINE_VALUES;
+	state->values_num = 0;
+	state->values.ptr = state->values_inline;
+	state->values_bytes = 0;
+
+	state->arena = NULL;
+	state->arena_used = 0;
+
+	state->run_ends = NULL;
+	state->runs_num = 0;
+	state->runs_alloc = 0;
+
+	state->weights = NULL;
+	state->weights_total = 0;
+	state->values_repeats = 0;
+
+	state->spill_file = NULL;
+	state->spill_weights = NULL;
+	state->spill_num = 0;
+	state->spill_bytes = 0;
+	state->spill_sample = NULL;
+	state->spill_sample_num = 0;
+	state->spill_sample_alloc = 0;
+	state->spill_sample_seed = UINT64CONST(0x9E3779B97F4A7C15);
+	state->spill_sample_next = 0;
+	state->spill_sample_w = 0;
+
+	state->counts = NULL;
+	state->counts_alloc = 0;
+	state->counts_num = 0;
+	state->counts_total = 0;
+
+	state->fractions = NULL;
+	state->fractions_num = 0;
+	state->fractions_bounds = NULL;
+	state->fractions_ndim = 0;
+
+	state->deserialized = false;
+	state->stats = median_track_stats ? palloc0(sizeof(MedianStats)) : NULL;
+
+	MemoryContextSwitchTo(old_context);
+
+	return state;
+}
+
+/*
+ * Check the values array of the state once it grew: switch to counts or
+ * compress runs of equal values at the checkpoints, and spill the values once
+ * they exceed work_mem.
+ */
+static void
+median_state_check(MedianState * state)
+{
+	if (values_checkpoint(state))
+	{
+		counts_try_begin(state, state->agg_context);
+		if (state->counts == NULL)
+			values_try_compress(state);
+	}
+	if (state->counts == NULL && values_exceed_work_mem(state))
+	{
+		values_try_compress(state);
+		if (values_exceed_work_mem(state))
+			values_spill(state, state->agg_context);
+	}
+}
+
+/*
+ * Add the value, standing for weight values, to the state.
+ *
+ * A value equal to the previous one only adds to its weight once the state is
+ * weighted.  Otherwise such repetitions are counted, so that the values array
+ * is compressed into runs of equal values when it grows or exceeds work_mem,
+ * if they make up most of it.
+ */
+static void
+median_state_add_any(MedianState * state, Datum val, uint64 weight)
+{
+	MemoryContext old_context;
+	struct varlena *unpacked = NULL;
+
+	if (state->counts != NULL)
+	{
+		counts_append(state, val, weight, state->agg_context);
+		return;
+	}
+
+	/*
+	 * Varlena values stored in tables mostly have short headers, while the
+	 * values array holds them detoasted, so they are only compared byte by
+	 * byte once they are detoasted as well
+	 */
+	if (state->type->values_kind == MEDIAN_VALUES_DATUM &&
+		state->type->arg_typlen == -1 &&
+		VARATT_IS_EXTENDED(DatumGetPointer(val)))
+	{
+		unpacked = PG_DETOAST_DATUM(val);
+		val = PointerGetDatum(unpacked);
+	}
+
+	if (state->values_num > 0 &&
+		values_equal(state, state->values_num - 1, val))
+	{
+		if (state->weights != NULL)
+		{
+			state->weights[state->values_num - 1] += weight;
+			state->weights_total += weight;
+			if (unpacked != NULL)
+				pfree(unpacked);
+			return;
+		}
+		state->values_repeats++;
+	}
+
+	/* By-reference values are copied and detoasted in agg_context */
+	old_context = MemoryContextSwitchTo(state->agg_context);
+	values_append(state, val, weight);
+	MemoryContextSwitchTo(old_context);
+
+	if (unpacked != NULL)
+		pfree(unpacked);
+
+	median_state_check(state);
+}
+
+/*
+ * Add the value to the state, see median_state_add_any().
+ *
+ * The common case of a native value which fits into the values array of an
+ * unweighted state is a plain array write.  As the allocated length of the
+ * array is limited by work_mem, the array is only checked once it's full or
+ * reaches a checkpoint.
+ */
+static inline void
+median_state_add(MedianState * state, Datum val, uint64 weight)
+{
+	uint32		i = state->values_num;
+
+	if (likely(state->type->values_kind != MEDIAN_VALUES_DATUM &&
+			   i < state->values_alloc && weight == 1 &&
+			   state->weights == NULL && state->counts == NULL))
+	{
+		if (i > 0 && values_equal(state, i - 1, val))
+			state->values_repeats++;
+
+		if (state->type->values_kind == MEDIAN_VALUES_INT64)
+			state->values.ints[i] = datum_get_int64(state->type->arg_typlen,
+													val);
+		else
+			state->values.floats[i] = datum_get_float8(state->type->arg_typlen,
+													   val);
+		state->values_num = i + 1;
+
+		if (unlikely(state->values_num == state->values_alloc ||
+					 values_checkpoint(state)))
+			median_state_check(state);
+		return;
+	}
+
+	median_state_add_any(state, val, weight);
+}
+
+/*
+ * Median state transfer function.
+ *
+ * This function is called for every value in the set that we are calculating
+ * the median for. On first call, the aggregate state, if any, needs to be
+ * initialized.  The call context is only checked then, like ordered-set
+ * aggregates do, as nothing but the aggregate can pass an internal state.
+ */
+Datum
+median_transfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+
+	/* If first call, initalize the transition state */
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext agg_context;
+
+		if (!AggCheckCallContext(fcinfo, &agg_context))
+			elog(ERROR, "median_transfn called in non-aggregate context");
+
+		state = median_state_create(fcinfo, agg_context);
+	}
+	else
+		state = (MedianState *) PG_GETARG_POINTER(0);
+
+	/* Copy the datum into the values array, but only if it's not null */
+	if (!PG_ARGISNULL(1))
+		median_state_add(state, PG_GETARG_DATUM(1), 1);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Weighted median state transfer function.
+ *
+ * The value stands for weight values, as if it was passed weight times.  Rows
+ * with NULL or zero weight are skipped.
+ */
+Datum
+median_weighted_transfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+	int64		weight;
+
+	if (PG_ARGISNULL(0))
+	{
+		MemoryContext agg_context;
+
+		if (!AggCheckCallContext(fcinfo, &agg_context))
+			elog(ERROR,
+				 "median_weighted_transfn called in non-aggregate context");
+
+		state = median_state_create(fcinfo, agg_context);
+	}
+	else
+		state = (MedianState *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1) || PG_ARGISNULL(2))
+		PG_RETURN_POINTER(state);
+
+	weight = PG_GETARG_INT64(2);
+	if (weight < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("weight " INT64_FORMAT " is negative", weight)));
+
+	if (weight > 0)
+		median_state_add(state, PG_GETARG_DATUM(1), (uint64) weight);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Comparison function over values.
+ */
+static inline int
+values_compare(MedianSortContext * ctx, Datum val1, Datum val2)
+{
+	COUNT_COMPARISON();
+	return DatumGetInt32(FunctionCall2Coll(&ctx->cmp_finfo, ctx->collation,
+										   val1, val2));
+}
+
+/* Below this size the selection falls back to insertion sort */
+#define SELECT_SMALL_THRESHOLD 16
+/* Above this size pivots are picked by the ninther rule */
+#define SELECT_NINTHER_THRESHOLD 40
+/* Above this size the selection picks its pivots from a sample */
+#define SELECT_SAMPLE_THRESHOLD 600
+
+/*
+ * Comparison of native floats.  NaNs are considered equal to each other and
+ * greater than any other value, as btree comparison of float types does.
+ */
+static inline int
+float8_compare(float8 val1, float8 val2)
+{
+	if (unlikely(isnan(val1)))
+		return isnan(val2) ? 0 : 1;
+	if (unlikely(isnan(val2)))
+		return -1;
+	return (val1 > val2) - (val1 < val2);
+}
+
+/*
+ * Comparison of sort items.  The abbreviated keys are compared first, and the
+ * values are compared in full only if the keys are equal.
+ */
+static inline int
+sortitem_compare(MedianSortItem a, MedianSortItem b, SortSupport ssup)
+{
+	int			cmp;
+
+	COUNT_COMPARISON();
+	cmp = ApplySortComparator(a.key, false, b.key, false, ssup);
+	if (cmp == 0 && ssup->abbrev_converter != NULL)
+		cmp = ApplySortAbbrevFullComparator(a.value, false, b.value, false,
+											ssup);
+	return cmp;
+}
+
+#define ST_PREFIX sortitem
+#define ST_ELEMENT_TYPE MedianSortItem
+#define ST_COMPARE(a, b, arg) sortitem_compare(a, b, arg)
+#define ST_COMPARE_ARG_TYPE SortSupportData
+#include "median_select.h"
+
+#include "median_simd.h"
+
+#define ST_PREFIX int64
+#define ST_ELEMENT_TYPE int64
+#define ST_COMPARE(a, b) (((a) > (b)) - ((a) < (b)))
+#define ST_PARTITION_LESS int64_partition_less
+#include "median_select.h"
+
+#define ST_PREFIX float8
+#define ST_ELEMENT_TYPE float8
+#define ST_COMPARE(a, b) float8_compare(a, b)
+#define ST_PARTITION_LESS float8_partition_less
+#include "median_select.h"
+
+#define ST_PREFIX weighteditem
+#define ST_ELEMENT_TYPE MedianWeightedItem
+#define ST_COMPARE(a, b, arg) sortitem_compare((a).item, (b).item, arg)
+#define ST_COMPARE_ARG_TYPE SortSupportData
+#define ST_ELEMENT_WEIGHT(a) ((a).weight)
+#include "median_select.h"
+
+#define ST_PREFIX weightedint64
+#define ST_ELEMENT_TYPE MedianWeightedInt64
+#define ST_COMPARE(a, b) (((a).value > (b).value) - ((a).value < (b).value))
+#define ST_ELEMENT_WEIGHT(a) ((a).weight)
+#include "median_select.h"
+
+#define ST_PREFIX weightedfloat8
+#define ST_ELEMENT_TYPE MedianWeightedFloat8
+#define ST_COMPARE(a, b) float8_compare((a).value, (b).value)
+#define ST_ELEMENT_WEIGHT(a) ((a).weight)
+#include "median_select.h"
+
+/*
+ * Get underliyng function's OID of the operator specified by oprname.
+ */
+static Oid
+operator_funcid(Oid arg_type, char *oprname, char *oprdesc)
+{
+	Oid			oprid;
+	Oid			oprfunc;
+
+	oprid = OpernameGetOprid(list_make1(makeString(oprname)), arg_type, arg_type);
+	if (!OidIsValid(oprid))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify a %s operator for type %s",
+						oprdesc, format_type_be(arg_type))));
+
+	oprfunc = get_opcode(oprid);
+	if (!OidIsValid(oprfunc))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify the procedure for the %s operator for type %s",
+						oprdesc, format_type_be(arg_type))));
+
+	return oprfunc;
+}
+
+/*
+ * Mean of two integers rounded towards zero, as (val1 + val2) / 2 gives, but
+ * without the risk of overflow.
+ */
+static inline int64
+int64_midpoint(int64 val1, int64 val2)
+{
+	/* The sum can't overflow if the signs differ */
+	if ((val1 < 0) != (val2 < 0))
+		return (val1 + val2) / 2;
+	return val1 / 2 + val2 / 2 + (val1 % 2 + val2 % 2) / 2;
+}
+
+/*
+ * Mean of two floats.  If the sum overflows, halve the arguments first.
+ */
+static inline float8
+float8_midpoint(float8 val1, float8 val2)
+{
+	float8		sum = val1 + val2;
+
+	if (unlikely(isinf(sum)) && !isinf(val1) && !isinf(val2))
+		return val1 / 2.0 + val2 / 2.0;
+	return sum / 2.0;
+}
+
+/*
+ * Make a numeric constant from its text representation.
+ */
+static Datum
+numeric_const(const char *str)
+{
+	return DirectFunctionCall3(numeric_in, CStringGetDatum(str),
+							   ObjectIdGetDatum(InvalidOid), Int32GetDatum(-1));
+}
+
+/*
+ * Get the cache of routines used to compute the mean of two datums.
+ *
+ * The cache lives in fn_extra of the final function, so catalog lookups are
+ * done once per query rather than once per group.  Plus and division
+ * operators are looked up only for types whose mean isn't computed natively.
+ */
+static MedianMeanCache *
+mean_cache_get(FmgrInfo *flinfo, Oid arg_type)
+{
+	MedianMeanCache *cache = (MedianMeanCache *) flinfo->fn_extra;
+	MemoryContext old_context;
+
+	if (cache != NULL && cache->arg_type == arg_type)
+		return cache;
+
+	if (cache == NULL)
+		cache = (MedianMeanCache *) MemoryContextAlloc(flinfo->fn_mcxt,
+													   sizeof(MedianMeanCache));
+	cache->arg_type = arg_type;
+
+	switch (getBaseType(arg_type))
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			cache->method = MEDIAN_MEAN_INT64;
+			old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+			cache->half = numeric_const("0.5");
+			cache->minus_half = numeric_const("-0.5");
+			MemoryContextSwitchTo(old_context);
+			break;
+		case FLOAT4OID:
+		case FLOAT8OID:
+			cache->method = MEDIAN_MEAN_FLOAT8;
+			break;
+		case NUMERICOID:
+			cache->method = MEDIAN_MEAN_NUMERIC;
+			old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+			cache->two = DirectFunctionCall1(int4_numeric, Int32GetDatum(2));
+			cache->half = numeric_const("0.5");
+			MemoryContextSwitchTo(old_context);
+			break;
+		default:
+			{
+				Oid			typinput;
+				Oid			typioparam;
+
+				/*
+				 * Look up the operators before marking the cache as valid, so
+				 * that if there are none it errors out on every call.
+				 */
+				cache->method = MEDIAN_MEAN_OPERATORS;
+				cache->arg_type = InvalidOid;
+
+				fmgr_info_cxt(operator_funcid(arg_type, "+", "plus"),
+							  &cache->plus_finfo, flinfo->fn_mcxt);
+				fmgr_info_cxt(operator_funcid(arg_type, "/", "division"),
+							  &cache->div_finfo, flinfo->fn_mcxt);
+
+				old_context = MemoryContextSwitchTo(flinfo->fn_mcxt);
+				getTypeInputInfo(arg_type, &typinput, &typioparam);
+				cache->two = OidInputFunctionCall(typinput, "2", typioparam, -1);
+				MemoryContextSwitchTo(old_context);
+
+				cache->arg_type = arg_type;
+			}
+			break;
+	}
+
+	flinfo->fn_extra = cache;
+	return cache;
+}
+
+/*
+ * Get mean of two datums.
+ *
+ * Integers and floats are averaged natively, numerics using numeric
+ * arithmetic directly.  For other types we use plus and division operators
+ * from the catalog for corresponding arg_type.
+ */
+static Datum
+datum_mean(MedianMeanCache * cache, int16 typlen, Oid collation,
+		   Datum arg1, Datum arg2)
+{
+	Datum		sumd;
+
+	switch (cache->method)
+	{
+		case MEDIAN_MEAN_INT64:
+			return int64_get_datum(typlen,
+								   int64_midpoint(datum_get_int64(typlen, arg1),
+												  datum_get_int64(typlen, arg2)));
+		case MEDIAN_MEAN_FLOAT8:
+			return float8_get_datum(typlen,
+									float8_midpoint(datum_get_float8(typlen, arg1),
+													datum_get_float8(typlen, arg2)));
+		case MEDIAN_MEAN_NUMERIC:
+			sumd = DirectFunctionCall2(numeric_add, arg1, arg2);
+			return DirectFunctionCall2(numeric_div, sumd, cache->two);
+		default:
+			sumd = FunctionCall2Coll(&cache->plus_finfo, collation,
+									 arg1, arg2);
+			return FunctionCall2Coll(&cache->div_finfo, collation,
+									 sumd, cache->two);
+	}
+}
+
+/*
+ * Exact mean of two integers as a numeric.  If the sum is odd, the midpoint
+ * rounded towards zero is half away from the mean, so a half is added to it
+ * with the sign of the sum.  The sum can't overflow if the midpoint is zero.
+ */
+static Datum
+int64_midpoint_numeric(MedianMeanCache * cache, int64 val1, int64 val2)
+{
+	int64		mid = int64_midpoint(val1, val2);
+	Datum		result = DirectFunctionCall1(int8_numeric, Int64GetDatum(mid));
+
+	if (((val1 ^ val2) & 1) == 0)
+		return result;
+	if (mid > 0 || (mid == 0 && val1 + val2 > 0))
+		return DirectFunctionCall2(numeric_add, result, cache->half);
+	return DirectFunctionCall2(numeric_add, result, cache->minus_half);
+}
+
+/*
+ * Get the value of the median as median_cont() returns it: a numeric for
+ * integers and numerics, a float8 for floats.  For an even number of values
+ * it is the exact mean of the two middle values.  Numerics are halved by
+ * multiplying by 0.5, which unlike the division doesn't round the result.
+ */
+static Datum
+datum_mean_cont(MedianMeanCache * cache, int16 typlen, Datum arg1,
+				Datum arg2, bool even)
+{
+	switch (cache->method)
+	{
+		case MEDIAN_MEAN_INT64:
+			if (!even)
+				return DirectFunctionCall1(int8_numeric,
+										   Int64GetDatum(datum_get_int64(typlen, arg1)));
+			return int64_midpoint_numeric(cache, datum_get_int64(typlen, arg1),
+										  datum_get_int64(typlen, arg2));
+		case MEDIAN_MEAN_FLOAT8:
+			if (!even)
+				return Float8GetDatum(datum_get_float8(typlen, arg1));
+			return Float8GetDatum(float8_midpoint(datum_get_float8(typlen, arg1),
+												  datum_get_float8(typlen, arg2)));
+		case MEDIAN_MEAN_NUMERIC:
+			if (!even)
+				return arg1;
+			return DirectFunctionCall2(numeric_mul,
+									   DirectFunctionCall2(numeric_add, arg1, arg2),
+									   cache->half);
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("median_cont is not supported for type %s",
+							format_type_be(cache->arg_type))));
+			return (Datum) 0;	/* keep compiler quiet */
+	}
+}
+
+/*
+ * Make sort items of the values of MEDIAN_VALUES_DATUM kind, using sort support
+ * of the type's ordering operator.  Abbreviated keys are used where the type
+ * supports them, unless abbrev_abort() finds them useless, checked the same
+ * way tuplesort does.
+ */
+static MedianSortItem *
+sortitems_make(MedianState * state, Oid collation, SortSupport ssup)
+{
+	MedianSortItem *items;
+	uint32		abbrev_next = 10;
+
+	if (!OidIsValid(state->type->lt_opr))
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("could not identify an ordering operator for type %s",
+						format_type_be(state->type->arg_type))));
+
+	memset(ssup, 0, sizeof(SortSupportData));
+	ssup->ssup_cxt = CurrentMemoryContext;
+	ssup->ssup_collation = collation;
+	ssup->ssup_nulls_first = false;
+	ssup->abbreviate = true;
+	PrepareSortSupportFromOrderingOp(state->type->lt_opr, ssup);
+
+	items = palloc(state->values_num * sizeof(MedianSortItem));
+	for (uint32 i = 0; i < state->values_num; i++)
+	{
+		items[i].value = state->values.datums[i];
+
+		if (ssup->abbrev_converter != NULL && i >= abbrev_next)
+		{
+			abbrev_next *= 2;
+			if (ssup->abbrev_abort(i, ssup))
+			{
+				/* Give up the abbreviation and compare the values in full */
+				ssup->comparator = ssup->abbrev_full_comparator;
+				ssup->abbrev_converter = NULL;
+				ssup->abbrev_abort = NULL;
+				ssup->abbrev_full_comparator = NULL;
+
+				for (uint32 j = 0; j < i; j++)
+					items[j].key = items[j].value;
+			}
+		}
+
+		if (ssup->abbrev_converter != NULL)
+			items[i].key = ssup->abbrev_converter(items[i].value, ssup);
+		else
+			items[i].key = items[i].value;
+	}
+
+	return items;
+}
+
+/*
+ * Store the values of the sort items back into the values array, in their
+ * new order.
+ */
+static void
+sortitems_store(MedianState * state, MedianSortItem * items)
+{
+	for (uint32 i = 0; i < state->values_num; i++)
+		state->values.datums[i] = items[i].value;
+	pfree(items);
+}
+
+/*
+ * Rearrange the values array so that the k-th smallest value is at position k.
+ * There is no need to sort all the values: the values are partitioned around
+ * the selected one.  If next isn't NULL, the position of the (k + 1)-th
+ * smallest value, the smallest value of the upper partition, is returned in
+ * it.
+ */
+static void
+values_select(MedianState * state, Oid collation, uint32 k, uint32 *next)
+{
+	SortSupportData ssup;
+	MedianSortItem *items;
+	uint32		last = state->values_num - 1;
+
+	Assert(k < last || next == NULL);
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			int64_select(state->values.ints, 0, last, k);
+			if (next != NULL)
+				*next = int64_min(state->values.ints, k + 1, last);
+			break;
+		case MEDIAN_VALUES_FLOAT8:
+			float8_select(state->values.floats, 0, last, k);
+			if (next != NULL)
+				*next = float8_min(state->values.floats, k + 1, last);
+			break;
+		default:
+			items = sortitems_make(state, collation, &ssup);
+			sortitem_select(items, 0, last, k, &ssup);
+			if (next != NULL)
+				*next = sortitem_min(items, k + 1, last, &ssup);
+			sortitems_store(state, items);
+			break;
+	}
+
+	/* The partitioning doesn't keep the sorted runs */
+	state->runs_num = 0;
+}
+
+/*
+ * Rearrange the values array so that the k-th smallest value is at position k
+ * for every k of ks, which are sorted in ascending order without duplicates.
+ * All the positions are selected in a single pass of recursive partitioning.
+ */
+static void
+values_multiselect(MedianState * state, Oid collation, uint32 *ks, int nks)
+{
+	SortSupportData ssup;
+	MedianSortItem *items;
+	uint32		last = state->values_num - 1;
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			int64_multiselect(state->values.ints, 0, last, ks, nks);
+			break;
+		case MEDIAN_VALUES_FLOAT8:
+			float8_multiselect(state->values.floats, 0, last, ks, nks);
+			break;
+		default:
+			items = sortitems_make(state, collation, &ssup);
+			sortitem_multiselect(items, 0, last, ks, nks, &ssup);
+			sortitems_store(state, items);
+			break;
+	}
+
+	/* The partitioning doesn't keep the sorted runs */
+	state->runs_num = 0;
+}
+
+/*
+ * Find the value of the given rank among the values of a weighted state, each
+ * value counted as many times as its weight.  If next isn't NULL, the value
+ * of the next rank is returned in it as well.  The values are selected along
+ * with their weights in an array of their own, the state isn't modified.
+ */
+static void
+values_weighted_select(MedianState * state, Oid collation, uint64 rank,
+					   Datum *val, Datum *next)
+{
+	uint32		last = state->values_num - 1;
+	uint32		pos;
+
+	Assert(state->weights != NULL);
+	Assert(rank < state->weights_total);
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			{
+				MedianWeightedInt64 *items;
+
+				items = palloc(state->values_num * sizeof(MedianWeightedInt64));
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					items[i].value = state->values.ints[i];
+					items[i].weight = state->weights[i];
+				}
+
+				pos = weightedint64_weighted_select(items, 0, last, &rank);
+				*val = int64_get_datum(state->type->arg_typlen,
+									   items[pos].value);
+				if (next != NULL)
+				{
+					if (rank + 1 >= items[pos].weight)
+						pos = weightedint64_min(items, pos + 1, last);
+					*next = int64_get_datum(state->type->arg_typlen,
+											items[pos].value);
+				}
+				pfree(items);
+				break;
+			}
+		case MEDIAN_VALUES_FLOAT8:
+			{
+				MedianWeightedFloat8 *items;
+
+				items = palloc(state->values_num * sizeof(MedianWeightedFloat8));
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					items[i].value = state->values.floats[i];
+					items[i].weight = state->weights[i];
+				}
+
+				pos = weightedfloat8_weighted_select(items, 0, last, &rank);
+				*val = float8_get_datum(state->type->arg_typlen,
+										items[pos].value);
+				if (next != NULL)
+				{
+					if (rank + 1 >= items[pos].weight)
+						pos = weightedfloat8_min(items, pos + 1, last);
+					*next = float8_get_datum(state->type->arg_typlen,
+											 items[pos].value);
+				}
+				pfree(items);
+				break;
+			}
+		default:
+			{
+				SortSupportData ssup;
+				MedianSortItem *sortitems;
+				MedianWeightedItem *items;
+
+				sortitems = sortitems_make(state, collation, &ssup);
+				items = palloc(state->values_num * sizeof(MedianWeightedItem));
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					items[i].item = sortitems[i];
+					items[i].weight = state->weights[i];
+				}
+				pfree(sortitems);
+
+				pos = weighteditem_weighted_select(items, 0, last, &rank,
+												   &ssup);
+				*val = items[pos].item.value;
+				if (next != NULL)
+				{
+					if (rank + 1 >= items[pos].weight)
+						pos = weighteditem_min(items, pos + 1, last, &ssup);
+					*next = items[pos].item.value;
+				}
+				pfree(items);
+				break;
+			}
+	}
+}
+
+/*
+ * Sort the weighted values array, each value along with its weight.
+ */
+static void
+values_weighted_sort(MedianState * state)
+{
+	uint32		last = state->values_num - 1;
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			{
+				MedianWeightedInt64 *items;
+
+				items = palloc(state->values_num * sizeof(MedianWeightedInt64));
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					items[i].value = state->values.ints[i];
+					items[i].weight = state->weights[i];
+				}
+				weightedint64_sort(items, 0, last);
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					state->values.ints[i] = items[i].value;
+					state->weights[i] = items[i].weight;
+				}
+				pfree(items);
+				break;
+			}
+		case MEDIAN_VALUES_FLOAT8:
+			{
+				MedianWeightedFloat8 *items;
+
+				items = palloc(state->values_num * sizeof(MedianWeightedFloat8));
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					items[i].value = state->values.floats[i];
+					items[i].weight = state->weights[i];
+				}
+				weightedfloat8_sort(items, 0, last);
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					state->values.floats[i] = items[i].value;
+					state->weights[i] = items[i].weight;
+				}
+				pfree(items);
+				break;
+			}
+		default:
+			{
+				SortSupportData ssup;
+				MedianSortItem *sortitems;
+				MedianWeightedItem *items;
+
+				sortitems = sortitems_make(state, state->collation, &ssup);
+				items = palloc(state->values_num * sizeof(MedianWeightedItem));
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					items[i].item = sortitems[i];
+					items[i].weight = state->weights[i];
+				}
+				pfree(sortitems);
+
+				weighteditem_sort(items, 0, last, &ssup);
+				for (uint32 i = 0; i < state->values_num; i++)
+				{
+					state->values.datums[i] = items[i].item.value;
+					state->weights[i] = items[i].weight;
+				}
+				pfree(items);
+				break;
+			}
+	}
+}
+
+/*
+ * Sort the values array using the collation of the state.
+ */
+static void
+values_sort(MedianState * state)
+{
+	SortSupportData ssup;
+	MedianSortItem *items;
+
+	if (state->values_num < 2)
+		return;
+
+	if (state->weights != NULL)
+	{
+		values_weighted_sort(state);
+		return;
+	}
+
+	switch (state->type->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			int64_sort(state->values.ints, 0, state->values_num - 1);
+			break;
+		case MEDIAN_VALUES_FLOAT8:
+			float8_sort(state->values.floats, 0, state->values_num - 1);
+			break;
+		default:
+			items = sortitems_make(state, state->collation, &ssup);
+			sortitem_sort(items, 0, state->values_num - 1, &ssup);
+			sortitems_store(state, items);
+			break;
+	}
+}
+
+/*
+ * Counts of distinct values.
+ *
+ * Integer inputs often have few distinct values, such as status codes or
+ * ages.  Once the values array turns out to hold many duplicates, the state
+ * switches to an open-addressing hash table of distinct values and their
+ * counts.  The memory used then depends on the number of distinct values
+ * only, combining states merges their tables, and the median is found by
+ * walking the sorted distinct values and summing their counts.  Should the
+ * table outgrow work_mem, the counted values are put back into the values
+ * array, which spills as usual.
+ */
+
+/*
+ * Hash an integer value, using the finalizer of MurmurHash3.
+ */
+static inline uint32
+counts_hash(int64 value)
+{
+	uint64		h = (uint64) value;
+
+	h ^= h >> 33;
+	h *= UINT64CONST(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
+
+	return (uint32) h;
+}
+
+/*
+ * Insert the value into the hash table of the given allocated length, which
+ * has room for it.
+ */
+static inline MedianCountsEntry *
+counts_lookup(MedianCountsEntry * counts, uint32 alloc, int64 value)
+{
+	uint32		mask = alloc - 1;
+	uint32		i = counts_hash(value) & mask;
+
+	while (counts[i].count != 0 && counts[i].value != value)
+		i = (i + 1) & mask;
+
+	return &counts[i];
+}
+
+/*
+ * Make the hash table of the state hold the given number of distinct values,
+ * keeping it at most half full.
+ */
+static void
+counts_reserve(MedianState * state, uint32 num, MemoryContext agg_context)
+{
+	MedianCountsEntry *counts;
+	uint32		alloc = Max(state->counts_alloc, 64);
+
+	/* The table is never enlarged beyond COUNTS_MAX_ALLOC */
+	while (alloc / 2 < num && alloc < COUNTS_MAX_ALLOC)
+		alloc *= 2;
+	if (alloc == state->counts_alloc)
+		return;
+
+	counts = MemoryContextAllocZero(agg_context,
+									alloc * sizeof(MedianCountsEntry));
+	for (uint32 i = 0; i < state->counts_alloc; i++)
+	{
+		MedianCountsEntry *entry = &state->counts[i];
+
+		if (entry->count != 0)
+			*counts_lookup(counts, alloc, entry->value) = *entry;
+	}
+
+	if (state->counts != NULL)
+		pfree(state->counts);
+	state->counts = counts;
+	state->counts_alloc = alloc;
+}
+
+/*
+ * Add count occurrences of the value to the hash table.
+ */
+static void
+counts_add(MedianState * state, int64 value, uint64 count,
+		   MemoryContext agg_context)
+{
+	MedianCountsEntry *entry;
+
+	if (state->counts_num >= state->counts_alloc / 2)
+		counts_reserve(state, state->counts_num + 1, agg_context);
+
+	entry = counts_lookup(state->counts, state->counts_alloc, value);
+	if (entry->count == 0)
+	{
+		entry->value = value;
+		state->counts_num++;
+	}
+	entry->count += count;
+	state->counts_total += count;
+}
+
+/*
+ * Check whether the hash table should be put back into the values array.
+ */
+static inline bool
+counts_exceed_work_mem(MedianState * state)
+{
+	return (Size) state->counts_alloc * sizeof(MedianCountsEntry) >
+		(Size) work_mem * 1024L ||
+		state->counts_alloc >= COUNTS_MAX_ALLOC;
+}
+
+/*
+ * Put the counted values back into the values array, as values weighted by
+ * their counts.
+ */
+static void
+counts_end(MedianState * state, MemoryContext agg_context)
+{
+	MedianCountsEntry *counts = state->counts;
+	uint32		alloc = state->counts_alloc;
+	MemoryContext old_context;
+
+	state->counts = NULL;
+	state->counts_alloc = 0;
+	state->counts_num = 0;
+	state->counts_total = 0;
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	values_make_weighted(state);
+	for (uint32 i = 0; i < alloc; i++)
+	{
+		if (counts[i].count == 0)
+			continue;
+
+		values_append(state, int64_get_datum(state->type->arg_typlen,
+											 counts[i].value),
+					  counts[i].count);
+		if (values_exceed_work_mem(state))
+			values_spill(state, agg_context);
+	}
+
+	MemoryContextSwitchTo(old_context);
+
+	pfree(counts);
+}
+
+/*
+ * Count the value of the state which keeps counts.
+ */
+static void
+counts_append(MedianState * state, Datum val, uint64 weight,
+			  MemoryContext agg_context)
+{
+	counts_add(state, datum_get_int64(state->type->arg_typlen, val), weight,
+			   agg_context);
+
+	if (counts_exceed_work_mem(state))
+		counts_end(state, agg_context);
+}
+
+/*
+ * Move the values array into the hash table, unless there are more than
+ * max_distinct distinct values.  Returns whether the state keeps counts.
+ * The array is shrunk, it isn't used until the table is put back into it.
+ */
+static bool
+counts_build(MedianState * state, uint32 max_distinct,
+			 MemoryContext agg_context)
+{
+	Assert(state->type->values_kind == MEDIAN_VALUES_INT64);
+	Assert(state->spill_file == NULL && state->counts == NULL);
+
+	/* Leave the table at most half full */
+	max_distinct = Min(max_distinct, COUNTS_MAX_ALLOC / 2);
+
+	counts_reserve(state, Min(state->values_num, max_distinct), agg_context);
+
+	for (uint32 i = 0; i < state->values_num; i++)
+	{
+		counts_add(state, state->values.ints[i], values_weight(state, i),
+				   agg_context);
+
+		if (state->counts_num > max_distinct)
+		{
+			pfree(state->counts);
+			state->counts = NULL;
+			state->counts_alloc = 0;
+			state->counts_num = 0;
+			state->counts_total = 0;
+			return false;
+		}
+	}
+
+	/* The values array goes back into the state */
+	if (!values_is_inline(state))
+		pfree(state->values.ptr);
+	state->values_num = 0;
+	state->values_alloc = MEDIAN_INLINE_VALUES;
+	state->values.ptr = state->values_inline;
+	state->values_repeats = 0;
+
+	/* The sorted runs went along with the values */
+	state->runs_num = 0;
+
+	if (state->weights != NULL)
+	{
+		pfree(state->weights);
+		state->weights = NULL;
+		state->weights_total = 0;
+	}
+
+	return true;
+}
+
+/*
+ * Switch the state to counts of distinct values, if the values array holds
+ * few of them.
+ */
+static void
+counts_try_begin(MedianState * state, MemoryContext agg_context)
+{
+	if (state->type->values_kind != MEDIAN_VALUES_INT64 ||
+		state->spill_file != NULL ||
+		state->values_num > COUNTS_CHECK_MAX)
+		return;
+
+	counts_build(state, values_total(state) / COUNTS_MIN_DUPS, agg_context);
+}
+
+/*
+ * Add a value of the source to the destination of counts_combine(), counting
+ * it if the destination keeps counts.  The counts end once they exceed
+ * work_mem, the values array spills.
+ */
+static void
+counts_combine_add(MedianState * dest, int64 value, uint64 count,
+				   MemoryContext agg_context)
+{
+	MemoryContext old_context;
+
+	if (dest->counts != NULL)
+	{
+		counts_add(dest, value, count, agg_context);
+		if (counts_exceed_work_mem(dest))
+			counts_end(dest, agg_context);
+		return;
+	}
+
+	old_context = MemoryContextSwitchTo(agg_context);
+	values_append(dest, int64_get_datum(dest->type->arg_typlen, value), count);
+	MemoryContextSwitchTo(old_context);
+
+	if (values_exceed_work_mem(dest))
+		values_spill(dest, agg_context);
+}
+
+/*
+ * Merge the values of source into destination, when either of them keeps
+ * counts.  The destination switches to counts too, if it hasn't spilled and
+ * has few enough distinct values for them to pay off; otherwise the counts of
+ * the source are appended to its values as weighted values.
+ */
+static void
+counts_combine(MedianState * source, MedianState * dest,
+			   MemoryContext agg_context)
+{
+	MedianValuesScan scan;
+	Datum		val;
+	uint64		weight;
+
+	if (dest->counts == NULL && dest->spill_file == NULL)
+		counts_build(dest, values_total(dest) / COUNTS_MIN_DUPS, agg_context);
+
+	if (source->counts != NULL)
+	{
+		if (dest->counts != NULL)
+			counts_reserve(dest, dest->counts_num + source->counts_num,
+						   agg_context);
+		for (uint32 i = 0; i < source->counts_alloc; i++)
+		{
+			MedianCountsEntry *entry = &source->counts[i];
+
+			if (entry->count != 0)
+				counts_combine_add(dest, entry->value, entry->count,
+								   agg_context);
+		}
+	}
+	else
+	{
+		values_scan_begin(&scan, source);
+		while (values_scan_next(&scan, &val, &weight))
+			counts_combine_add(dest,
+							   datum_get_int64(dest->type->arg_typlen, val),
+							   weight, agg_context);
+		values_scan_end(&scan);
+	}
+}
+
+/*
+ * Comparison function for qsort() over entries of the hash table.
+ */
+static int
+counts_entry_cmp(const void *a, const void *b)
+{
+	int64		val1 = ((const MedianCountsEntry *) a)->value;
+	int64		val2 = ((const MedianCountsEntry *) b)->value;
+
+	return val1 < val2 ? -1 : val1 > val2 ? 1 : 0;
+}
+
+/*
+ * Find the values of the given ranks, sorted in ascending order, among the
+ * counted values.  The distinct values are sorted and their counts summed up
+ * until each rank is reached.
+ *
+ * The state isn't modified, so that the final function can be called again.
+ */
+static void
+counts_select(MedianState * state, uint64 *ranks, int nranks, Datum *vals)
+{
+	MedianCountsEntry *entries;
+	uint32		num = 0;
+	uint64		total = 0;
+	int			r = 0;
+
+	entries = palloc(state->counts_num * sizeof(MedianCountsEntry));
+	for (uint32 i = 0; i < state->counts_alloc; i++)
+	{
+		if (state->counts[i].count != 0)
+			entries[num++] = state->counts[i];
+	}
+	qsort(entries, num, sizeof(MedianCountsEntry), counts_entry_cmp);
+
+	for (uint32 i = 0; i < num && r < nranks; i++)
+	{
+		total += entries[i].count;
+		while (r < nranks && ranks[r] < total)
+			vals[r++] = int64_get_datum(state->type->arg_typlen,
+										  entries[i].value);
+	}
+
+	pfree(entries);
+}
+
+/*
+ * Module initialization.
+ */
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("median.track_stats",
+							 "Collects statistics of median() and percentiles() states.",
+							 "The final function reports them at DEBUG1 level, "
+							 "they are returned by median_last_stats() as well.",
+							 &median_track_stats,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	EmitWarningsOnPlaceholders("median");
+}
+
+/*
+ * Start the statistics of a final function call.  The algorithm is chosen by
+ * the representation of the values, select_path names the in-memory
+ * selection the final function does otherwise.
+ */
+static void
+stats_final_begin(MedianState * state, const char *select_path)
+{
+	MedianStats *stats = state->stats;
+
+	if (stats == NULL)
+		return;
+
+	if (state->counts != NULL)
+		stats->path = "counts";
+	else if (state->spill_file != NULL)
+		stats->path = "spill";
+	else if (values_all_sorted(state))
+		stats->path = "runs";
+	else if (state->weights != NULL)
+		stats->path = "weighted";
+	else
+		stats->path = select_path;
+
+	INSTR_TIME_SET_CURRENT(stats->final_start);
+	stats->final_comparisons = median_comparisons;
+}
+
+/*
+ * Finish the statistics of a final function call, report them and keep them
+ * as the last statistics of the backend.
+ */
+static void
+stats_final_end(MedianState * state)
+{
+	MedianStats *stats = state->stats;
+	Size		value_size = MEDIAN_VALUE_SIZE(state);
+	instr_time	elapsed;
+
+	if (stats == NULL)
+		return;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, stats->final_start);
+	stats->final_ms = INSTR_TIME_GET_MILLISEC(elapsed);
+	stats->comparisons = median_comparisons - stats->final_comparisons;
+
+	stats->values_num = values_total(state);
+	stats->memory_bytes = (uint64) state->values_alloc *
+		(value_size + (state->weights != NULL ? sizeof(uint64) : 0)) +
+		state->values_bytes +
+		(uint64) state->counts_alloc * sizeof(MedianCountsEntry);
+	stats->spilled_bytes = state->spill_num *
+		(value_size + (state->spill_weights != NULL ? sizeof(uint64) : 0)) +
+		state->spill_bytes;
+
+	elog(DEBUG1, "median: %s of " UINT64_FORMAT " values, "
+		 UINT64_FORMAT " bytes in memory, " UINT64_FORMAT " bytes spilled, "
+		 UINT64_FORMAT " resizes, " UINT64_FORMAT " spills, "
+		 UINT64_FORMAT " combines, " UINT64_FORMAT " bytes deserialized in %.3f ms, "
+		 UINT64_FORMAT " comparisons in %.3f ms",
+		 stats->path, stats->values_num, stats->memory_bytes,
+		 stats->spilled_bytes, stats->resizes, stats->spills, stats->combines,
+		 stats->deserialized_bytes, stats->deserialize_ms,
+		 stats->comparisons, stats->final_ms);
+
+	last_stats = *stats;
+	last_stats_valid = true;
+}
+
+/*
+ * Add the statistics of a partial state to the state it is combined into.
+ */
+static void
+stats_combine(MedianState * source, MedianState * dest)
+{
+	if (dest->stats == NULL)
+		return;
+
+	dest->stats->combines++;
+	if (source->stats != NULL)
+	{
+		dest->stats->resizes += source->stats->resizes;
+		dest->stats->spills += source->stats->spills;
+		dest->stats->combines += source->stats->combines;
+		dest->stats->deserialized_bytes += source->stats->deserialized_bytes;
+		dest->stats->deserialize_ms += source->stats->deserialize_ms;
+	}
+}
+
+/*
+ * Return the statistics of the last state finalized by the backend, or NULL
+ * if there is none.
+ */
+Datum
+median_last_stats(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[11];
+	bool		nulls[11];
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (!last_stats_valid)
+		PG_RETURN_NULL();
+
+	memset(nulls, 0, sizeof(nulls));
+	values[0] = CStringGetTextDatum(last_stats.path);
+	values[1] = Int64GetDatum((int64) last_stats.values_num);
+	values[2] = Int64GetDatum((int64) last_stats.memory_bytes);
+	values[3] = Int64GetDatum((int64) last_stats.spilled_bytes);
+	values[4] = Int64GetDatum((int64) last_stats.resizes);
+	values[5] = Int64GetDatum((int64) last_stats.spills);
+	values[6] = Int64GetDatum((int64) last_stats.combines);
+	values[7] = Int64GetDatum((int64) last_stats.deserialized_bytes);
+	values[8] = Float8GetDatum(last_stats.deserialize_ms);
+	values[9] = Int64GetDatum((int64) last_stats.comparisons);
+	values[10] = Float8GetDatum(last_stats.final_ms);
+
+	tupdesc = BlessTupleDesc(tupdesc);
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values,
+													  nulls)));
+}
+
+/*
+ * Select the middle element of the state.  For an even number of values the
+ * second middle element is selected as well.
+ */
+static void
+median_select_middle(MedianState * state, Oid collation, uint64 values_num,
+					 Datum *first, Datum *second)
+{
+	bool		even = values_num % 2 == 0;
+
+	if (state->counts != NULL)
+	{
+		uint64		ranks[2];
+		Datum		vals[2];
+
+		ranks[0] = (values_num - 1) / 2;
+		ranks[1] = ranks[0] + 1;
+		counts_select(state, ranks, even ? 2 : 1, vals);
+
+		*first = vals[0];
+		if (even)
+			*second = vals[1];
+	}
+	else if (state->spill_file != NULL)
+		values_spill_select(state, collation, (values_num - 1) / 2,
+							first, even ? second : NULL);
+	else if (values_all_sorted(state))
+		values_runs_select(state, collation, (values_num - 1) / 2,
+						   first, even ? second : NULL);
+	else if (state->weights != NULL)
+		values_weighted_select(state, collation, (values_num - 1) / 2,
+							   first, even ? second : NULL);
+	else
+	{
+		uint32		first_pos = (values_num - 1) / 2;
+		uint32		second_pos;
+
+		values_select(state, collation, first_pos,
+					  even ? &second_pos : NULL);
+
+		*first = values_get_datum(state, first_pos);
+		if (even)
+			*second = values_get_datum(state, second_pos);
+	}
+}
+
+/*
+ * Find the median of the values of the state, which has some.  The mean
+ * routines are cached in fn_extra of the given function.
+ */
+static Datum
+median_state_result(MedianState * state, FmgrInfo *flinfo, Oid collation)
+{
+	uint64		values_num = values_total(state);
+	Datum		first;
+	Datum		second = (Datum) 0;
+	Datum		result;
+
+	stats_final_begin(state, "select");
+
+	median_select_middle(state, collation, values_num, &first, &second);
+
+	/* For even number of rows get mean of two middle elements */
+	if (values_num % 2 == 0)
+	{
+		MedianMeanCache *cache = mean_cache_get(flinfo, state->type->arg_type);
+
+		result = datum_mean(cache, state->type->arg_typlen, collation,
+							first, second);
+	}
+	/* For odd number of rows return the middle element */
+	else
+		result = first;
+
+	stats_final_end(state);
+
+	return result;
+}
+
+/*
+ * Median final function.
+ *
+ * This function is called after all values in the median set has been
+ * processed by the state transfer function. It should perform any necessary
+ * post processing and clean up any temporary state.
+ */
+Datum
+median_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_finalfn called in non-aggregate context");
+
+	/* If there were no regular rows, the result is NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianState *) PG_GETARG_POINTER(0);
+
+	/* values_num could be zero if we only saw NULL input values */
+	if (values_total(state) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_DATUM(median_state_result(state, fcinfo->flinfo,
+										PG_GET_COLLATION()));
+}
+
+/*
+ * median_cont() final function.
+ *
+ * The same as median_finalfn(), except that the median of integers is
+ * returned as a numeric, so that the mean of two middle elements isn't
+ * rounded, and the median of numerics is the exact mean.
+ */
+Datum
+median_cont_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+	MemoryContext agg_context;
+	MedianMeanCache *cache;
+	uint64		values_num;
+	Datum		first;
+	Datum		second = (Datum) 0;
+	Datum		result;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_cont_finalfn called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianState *) PG_GETARG_POINTER(0);
+	values_num = values_total(state);
+
+	if (values_num == 0)
+		PG_RETURN_NULL();
+
+	stats_final_begin(state, "select");
+
+	median_select_middle(state, PG_GET_COLLATION(), values_num,
+						 &first, &second);
+
+	cache = mean_cache_get(fcinfo->flinfo, state->type->arg_type);
+	result = datum_mean_cont(cache, state->type->arg_typlen, first, second,
+							 values_num % 2 == 0);
+
+	stats_final_end(state);
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * Allocate the fractions of percentiles() and the bounds of their array in
+ * the given memory context.
+ */
+static void
+fractions_alloc(MedianState * state, int num, int ndim, MemoryContext context)
+{
+	state->fractions = MemoryContextAlloc(context,
+										  Max(num, 1) * sizeof(float8));
+	state->fractions_num = num;
+	state->fractions_bounds = MemoryContextAlloc(context, Max(2 * ndim, 1) *
+												 sizeof(int));
+	state->fractions_ndim = ndim;
+}
+
+/*
+ * Set the fractions of percentiles() from the array passed to the transition
+ * function.  They are checked the same way percentile_disc() checks its
+ * fractions, and the result keeps the dimensions of their array as well.
+ */
+static void
+fractions_set(MedianState * state, ArrayType *array, MemoryContext agg_context)
+{
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	int			ndim = ARR_NDIM(array);
+
+	deconstruct_array(array, FLOAT8OID, sizeof(float8), FLOAT8PASSBYVAL, 'd',
+					  &elems, &nulls, &nelems);
+
+	fractions_alloc(state, nelems, ndim, agg_context);
+	memcpy(state->fractions_bounds, ARR_DIMS(array), ndim * sizeof(int));
+	memcpy(state->fractions_bounds + ndim, ARR_LBOUND(array),
+		   ndim * sizeof(int));
+
+	for (int i = 0; i < nelems; i++)
+	{
+		float8		fraction;
+
+		if (nulls[i])
+		{
+			state->fractions[i] = -1;
+			continue;
+		}
+
+		fraction = DatumGetFloat8(elems[i]);
+		if (isnan(fraction) || fraction < 0 || fraction > 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+					 errmsg("percentile value %g is not between 0 and 1",
+							fraction)));
+
+		state->fractions[i] = fraction;
+	}
+
+	pfree(elems);
+	pfree(nulls);
+}
+
+/*
+ * Copy the fractions of percentiles() from source into destination, unless
+ * the destination has them already.
+ */
+static void
+fractions_copy(MedianState * source, MedianState * dest,
+			   MemoryContext agg_context)
+{
+	if (dest->fractions != NULL || source->fractions == NULL)
+		return;
+
+	fractions_alloc(dest, source->fractions_num, source->fractions_ndim,
+					agg_context);
+	memcpy(dest->fractions, source->fractions,
+		   source->fractions_num * sizeof(float8));
+	memcpy(dest->fractions_bounds, source->fractions_bounds,
+		   2 * source->fractions_ndim * sizeof(int));
+}
+
+/*
+ * Percentiles state transfer function.
+ *
+ * The values are accumulated by median_transfn().  The fractions are taken
+ * from the first row where they aren't NULL, they are expected to be the
+ * same for all rows.
+ */
+Datum
+percentiles_transfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+
+	if (PG_ARGISNULL(0) && !AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "percentiles_transfn called in non-aggregate context");
+
+	state = (MedianState *) DatumGetPointer(median_transfn(fcinfo));
+
+	if (state->fractions == NULL && !PG_ARGISNULL(2))
+		fractions_set(state, PG_GETARG_ARRAYTYPE_P(2), state->agg_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/* Requested rank of a percentile, along with its position in the result */
+typedef struct MedianPercentile
+{
+	uint64		rank;
+	int			index;
+}	MedianPercentile;
+
+/*
+ * Comparison function for qsort() over percentiles.
+ */
+static int
+percentile_cmp(const void *a, const void *b)
+{
+	const MedianPercentile *p1 = (const MedianPercentile *) a;
+	const MedianPercentile *p2 = (const MedianPercentile *) b;
+
+	if (p1->rank != p2->rank)
+		return p1->rank < p2->rank ? -1 : 1;
+	return p1->index - p2->index;
+}
+
+/*
+ * Percentiles final function.
+ *
+ * Returns an array holding the value of each requested fraction, the first
+ * value whose position in the ordering equals or exceeds the fraction of the
+ * number of values.  The ranks of all the fractions are selected at once.
+ */
+Datum
+percentiles_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianState *state;
+	MemoryContext agg_context;
+	uint64		values_num;
+	MedianPercentile *percentiles;
+	int			npercentiles = 0;
+	Datum	   *results;
+	bool	   *nulls;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "percentiles_finalfn called in non-aggregate context");
+
+	/* If there were no regular rows, the result is NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianState *) PG_GETARG_POINTER(0);
+	values_num = values_total(state);
+
+	/* The result is NULL if we only saw NULL values or fractions */
+	if (values_num == 0 || state->fractions == NULL)
+		PG_RETURN_NULL();
+
+	percentiles = palloc(Max(state->fractions_num, 1) *
+						 sizeof(MedianPercentile));
+	results = palloc(Max(state->fractions_num, 1) * sizeof(Datum));
+	nulls = palloc(Max(state->fractions_num, 1) * sizeof(bool));
+
+	for (int i = 0; i < state->fractions_num; i++)
+	{
+		float8		fraction = state->fractions[i];
+		uint64		rank;
+
+		nulls[i] = fraction < 0;
+		results[i] = (Datum) 0;
+		if (nulls[i])
+			continue;
+
+		rank = (uint64) ceil(fraction * values_num);
+		percentiles[npercentiles].rank = Min(Max(rank, 1), values_num) - 1;
+		percentiles[npercentiles].index = i;
+		npercentiles++;
+	}
+
+	qsort(percentiles, npercentiles, sizeof(MedianPercentile), percentile_cmp);
+
+	stats_final_begin(state, "multiselect");
+
+	if (npercentiles == 0)
+	{
+		/* Only NULL fractions, or none at all */
+	}
+	else if (state->counts != NULL)
+	{
+		uint64	   *ranks = palloc(npercentiles * sizeof(uint64));
+		Datum	   *vals = palloc(npercentiles * sizeof(Datum));
+
+		for (int i = 0; i < npercentiles; i++)
+			ranks[i] = percentiles[i].rank;
+
+		counts_select(state, ranks, npercentiles, vals);
+
+		for (int i = 0; i < npercentiles; i++)
+			results[percentiles[i].index] = vals[i];
+
+		pfree(ranks);
+		pfree(vals);
+	}
+	else if (state->spill_file != NULL || state->weights != NULL ||
+			 values_all_sorted(state))
+	{
+		/* Select the ranks one by one, each rank is selected only once */
+		for (int i = 0; i < npercentiles; i++)
+		{
+			MedianPercentile *p = &percentiles[i];
+
+			if (i > 0 && p->rank == percentiles[i - 1].rank)
+				results[p->index] = results[percentiles[i - 1].index];
+			else if (state->spill_file != NULL)
+				values_spill_select(state, PG_GET_COLLATION(), p->rank,
+									&results[p->index], NULL);
+			else if (values_all_sorted(state))
+				values_runs_select(state, PG_GET_COLLATION(), p->rank,
+								   &results[p->index], NULL);
+			else
+				values_weighted_select(state, PG_GET_COLLATION(), p->rank,
+									   &results[p->index], NULL);
+		}
+	}
+	else
+	{
+		uint32	   *ks = palloc(npercentiles * sizeof(uint32));
+		int			nks = 0;
+
+		for (int i = 0; i < npercentiles; i++)
+		{
+			if (nks == 0 || ks[nks - 1] != percentiles[i].rank)
+				ks[nks++] = percentiles[i].rank;
+		}
+
+		values_multiselect(state, PG_GET_COLLATION(), ks, nks);
+
+		for (int i = 0; i < npercentiles; i++)
+			results[percentiles[i].index] =
+				values_get_datum(state, percentiles[i].rank);
+
+		pfree(ks);
+	}
+
+	stats_final_end(state);
+
+	/* The result has the same dimensions as the array of fractions */
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(results, nulls,
+											 state->fractions_ndim,
+											 state->fractions_bounds,
+											 state->fractions_bounds +
+											 state->fractions_ndim,
+											 state->type->arg_type,
+											 state->type->arg_typlen,
+											 state->type->arg_typbyval,
+											 state->type->arg_typalign));
+}
+
+/*
+ * Median of the elements of an array, NULL elements are skipped.
+ *
+ * The selection is done over the array itself, without the aggregate state.
+ * Arrays of 8-byte integers and floats without NULLs are selected in place,
+ * in a copy of the array made by detoasting it, elements of other types are
+ * selected among datums pointing into the array.
+ */
+Datum
+array_median(PG_FUNCTION_ARGS)
+{
+	ArrayType  *array;
+	Oid			elem_type = get_fn_expr_argtype(fcinfo->flinfo, 0);
+	MedianState state;
+	MedianTypeDesc desc;
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	uint32		values_num = 0;
+	Datum		first;
+	Datum		second = (Datum) 0;
+	Datum		result;
+
+	if (!OidIsValid(elem_type))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("could not determine input data type")));
+
+	/* The argument may be a domain over an array */
+	elem_type = get_base_element_type(elem_type);
+	if (!OidIsValid(elem_type))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("input data type is not an array")));
+
+	memset(&state, 0, sizeof(MedianState));
+	typedesc_init(&desc, elem_type, CurrentMemoryContext);
+	state.type = &desc;
+
+	if (desc.values_kind != MEDIAN_VALUES_DATUM &&
+		desc.arg_typlen == sizeof(int64))
+	{
+		array = PG_GETARG_ARRAYTYPE_P_COPY(0);
+		if (!array_contains_nulls(array))
+		{
+			state.values.ptr = ARR_DATA_PTR(array);
+			values_num = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+		}
+	}
+	else
+		array = PG_GETARG_ARRAYTYPE_P(0);
+
+	if (state.values.ptr == NULL)
+	{
+		deconstruct_array(array, elem_type, desc.arg_typlen,
+						  desc.arg_typbyval, desc.arg_typalign,
+						  &elems, &nulls, &nelems);
+
+		/* Native values are converted in place of the datums, if they fit */
+		if (desc.values_kind == MEDIAN_VALUES_DATUM ||
+			sizeof(Datum) >= sizeof(int64))
+			state.values.ptr = elems;
+		else
+			state.values.ptr = palloc(Max(nelems, 1) * sizeof(int64));
+		for (int i = 0; i < nelems; i++)
+		{
+			if (nulls[i])
+				continue;
+
+			switch (desc.values_kind)
+			{
+				case MEDIAN_VALUES_INT64:
+					state.values.ints[values_num++] =
+						datum_get_int64(desc.arg_typlen, elems[i]);
+					break;
+				case MEDIAN_VALUES_FLOAT8:
+					state.values.floats[values_num++] =
+						datum_get_float8(desc.arg_typlen, elems[i]);
+					break;
+				default:
+					state.values.datums[values_num++] = elems[i];
+					break;
+			}
+		}
+	}
+
+	if (values_num == 0)
+		PG_RETURN_NULL();
+
+	state.values_num = values_num;
+	state.values_alloc = values_num;
+
+	median_select_middle(&state, PG_GET_COLLATION(), values_num,
+						 &first, &second);
+
+	if (values_num % 2 == 0)
+		result = datum_mean(mean_cache_get(fcinfo->flinfo, elem_type),
+							desc.arg_typlen, PG_GET_COLLATION(),
+							first, second);
+	/* The middle element may point into the array */
+	else
+		result = datumCopy(first, desc.arg_typbyval, desc.arg_typlen);
+
+	PG_RETURN_DATUM(result);
+}
+
+/*
+ * State of the element-wise median of float8 arrays.  The values of each
+ * position are kept in a column of their own, NULL elements are skipped.
+ */
+typedef struct MedianArrayState
+{
+	/* Number of positions and the lower bound of the first array */
+	int			positions;
+	int			lbound;
+	/* Number of arrays accumulated, and the allocated length of the columns */
+	uint32		rows;
+	uint32		rows_alloc;
+	/* Positions' columns of values, one after another */
+	float8	   *values;
+	/* Number of values in each column */
+	uint32	   *counts;
+}	MedianArrayState;
+
+/*
+ * Element-wise median state transfer function.
+ *
+ * All the arrays have to be of the same length, NULL arrays are skipped.
+ */
+Datum
+median_array_transfn(PG_FUNCTION_ARGS)
+{
+	MedianArrayState *state;
+	MemoryContext agg_context;
+	ArrayType  *array;
+	int			nitems;
+	char	   *data;
+	bits8	   *bitmap;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_array_transfn called in non-aggregate context");
+
+	state = PG_ARGISNULL(0) ? NULL :
+		(MedianArrayState *) PG_GETARG_POINTER(0);
+
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
+
+	array = PG_GETARG_ARRAYTYPE_P(1);
+	if (ARR_NDIM(array) > 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("cannot compute element-wise median of multidimensional arrays")));
+	nitems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+
+	if (state == NULL)
+	{
+		state = (MedianArrayState *) MemoryContextAllocZero(agg_context,
+															sizeof(MedianArrayState));
+		state->positions = nitems;
+		state->lbound = nitems > 0 ? ARR_LBOUND(array)[0] : 1;
+		state->counts = MemoryContextAllocZero(agg_context,
+											   Max(nitems, 1) * sizeof(uint32));
+	}
+	else if (nitems != state->positions)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("cannot compute element-wise median of arrays of different lengths")));
+
+	if (nitems == 0)
+		PG_RETURN_POINTER(state);
+
+	/* Grow the columns, moving them apart from the last one */
+	if (state->rows == state->rows_alloc)
+	{
+		uint32		alloc = Max(state->rows_alloc * 2, 8);
+
+		if ((Size) alloc * nitems > MaxAllocHugeSize / sizeof(float8))
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("too many arrays for element-wise median")));
+
+		if (state->values == NULL)
+			state->values = MemoryContextAllocHuge(agg_context,
+												   (Size) alloc * nitems * sizeof(float8));
+		else
+		{
+			state->values = repalloc_huge(state->values,
+										  (Size) alloc * nitems * sizeof(float8));
+			for (int pos = nitems - 1; pos > 0; pos--)
+				memmove(state->values + (Size) pos * alloc,
+						state->values + (Size) pos * state->rows_alloc,
+						state->counts[pos] * sizeof(float8));
+		}
+		state->rows_alloc = alloc;
+	}
+
+	data = ARR_DATA_PTR(array);
+	bitmap = ARR_NULLBITMAP(array);
+	for (int pos = 0; pos < nitems; pos++)
+	{
+		float8		val;
+
+		if (bitmap != NULL && (bitmap[pos / 8] & (1 << (pos % 8))) == 0)
+			continue;
+
+		memcpy(&val, data, sizeof(float8));
+		data += sizeof(float8);
+		state->values[(Size) pos * state->rows_alloc + state->counts[pos]++] = val;
+	}
+	state->rows++;
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Element-wise median final function.
+ *
+ * Returns an array of the medians of each position, NULL for positions that
+ * only had NULL elements.  Each column is selected in place.
+ */
+Datum
+median_array_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianArrayState *state;
+	Datum	   *results;
+	bool	   *nulls;
+	int			dims[1];
+	int			lbs[1];
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "median_array_finalfn called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianArrayState *) PG_GETARG_POINTER(0);
+	if (state->positions == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(FLOAT8OID));
+
+	results = palloc(state->positions * sizeof(Datum));
+	nulls = palloc(state->positions * sizeof(bool));
+
+	for (int pos = 0; pos < state->positions; pos++)
+	{
+		float8	   *column = state->values + (Size) pos * state->rows_alloc;
+		uint32		count = state->counts[pos];
+		uint32		k = (count - 1) / 2;
+
+		nulls[pos] = count == 0;
+		if (count == 0)
+			continue;
+
+		float8_select(column, 0, count - 1, k);
+		if (count % 2 == 0)
+		{
+			uint32		next = float8_min(column, k + 1, count - 1);
+
+			results[pos] = Float8GetDatum(float8_midpoint(column[k],
+														  column[next]));
+		}
+		else
+			results[pos] = Float8GetDatum(column[k]);
+	}
+
+	dims[0] = state->positions;
+	lbs[0] = state->lbound;
+
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(results, nulls, 1, dims, lbs,
+											 FLOAT8OID, sizeof(float8),
+											 FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Copy median internal state items from source into destination.
+ */
+static void
+medianitems_copy(MedianState * source, MedianState * dest,
+				 MemoryContext agg_context)
+{
+	MemoryContext old_context;
+
+	/*
+	 * Spilled values are read back one by one, and so are the values which
+	 * wouldn't fit into the values array of the destination at once
+	 */
+	if (source->spill_file != NULL ||
+		(uint64) dest->values_num + source->values_num > MEDIAN_MAX_VALUES)
+	{
+		MedianValuesScan scan;
+		Datum		val;
+		uint64		weight;
+
+		values_scan_begin(&scan, source);
+		while (values_scan_next(&scan, &val, &weight))
+		{
+			old_context = MemoryContextSwitchTo(agg_context);
+			values_append(dest, val, weight);
+			MemoryContextSwitchTo(old_context);
+
+			if (values_exceed_work_mem(dest))
+				values_spill(dest, agg_context);
+		}
+		values_scan_end(&scan);
+		return;
+	}
+
+	/*
+	 * Sorted runs of the source stay sorted runs, as long as they directly
+	 * follow the runs of the destination
+	 */
+	if (values_sorted_num(source) == source->values_num &&
+		values_sorted_num(dest) == dest->values_num)
+	{
+		for (int i = 0; i < source->runs_num; i++)
+			values_add_run(dest, dest->values_num + source->run_ends[i],
+						   agg_context);
+	}
+
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	if (source->weights != NULL && dest->weights == NULL)
+		values_make_weighted(dest);
+
+	/* Enlarge values[] if needed */
+	values_reserve(dest, source->values_num);
+
+	/* Native values don't reference any memory and are copied at once */
+	if (source->type->values_kind != MEDIAN_VALUES_DATUM)
+	{
+		memcpy((char *) dest->values.ptr +
+			   dest->values_num * MEDIAN_VALUE_SIZE(dest),
+			   source->values.ptr,
+			   source->values_num * MEDIAN_VALUE_SIZE(source));
+		if (dest->weights != NULL)
+		{
+			for (uint32 i = 0; i < source->values_num; i++)
+				dest->weights[dest->values_num + i] = values_weight(source, i);
+			dest->weights_total += values_total(source);
+		}
+		dest->values_num += source->values_num;
+	}
+	else
+	{
+		for (int i = 0; i < source->values_num; i++)
+			values_append(dest, source->values.datums[i],
+						  values_weight(source, i));
+	}
+
+	MemoryContextSwitchTo(old_context);
+
+	if (values_exceed_work_mem(dest))
+		values_spill(dest, agg_context);
+	else
+		values_trim(dest);
+}
+
+/*
+ * Move median internal state items from source into destination.  The source
+ * must be in agg_context, its memory is taken over and it is freed.
+ */
+static void
+medianitems_move(MedianState * source, MedianState * dest,
+				 MemoryContext agg_context)
+{
+	Size		value_size = MEDIAN_VALUE_SIZE(dest);
+
+	Assert(source->spill_file == NULL);
+
+	/* Both states are weighted if either of them is */
+	if (source->weights != NULL && dest->weights == NULL)
+		values_make_weighted(dest);
+	else if (dest->weights != NULL && source->weights == NULL)
+		values_make_weighted(source);
+
+	/*
+	 * Keep the larger array and append the values of the smaller one to it.
+	 * The arrays are swapped together with their runs and weights, and with
+	 * the chunks holding their by-reference values, so that spilling the
+	 * destination below frees only the chunks of its own values.
+	 */
+	if (source->values_alloc > dest->values_alloc)
+	{
+		MedianState tmp = *dest;
+
+		dest->values = source->values;
+		dest->values_num = source->values_num;
+		dest->values_alloc = source->values_alloc;
+		dest->values_bytes = source->values_bytes;
+		dest->arena = source->arena;
+		dest->arena_used = source->arena_used;
+		dest->run_ends = source->run_ends;
+		dest->runs_num = source->runs_num;
+		dest->runs_alloc = source->runs_alloc;
+		dest->weights = source->weights;
+
+		source->values = tmp.values;
+		if (tmp.values.ptr == (void *) dest->values_inline)
+		{
+			/* The inline values move along with the array */
+			memcpy(source->values_inline, dest->values_inline,
+				   sizeof(dest->values_inline));
+			source->values.ptr = source->values_inline;
+		}
+		source->values_num = tmp.values_num;
+		source->values_alloc = tmp.values_alloc;
+		source->values_bytes = tmp.values_bytes;
+		source->arena = tmp.arena;
+		source->arena_used = tmp.arena_used;
+		source->run_ends = tmp.run_ends;
+		source->runs_num = tmp.runs_num;
+		source->runs_alloc = tmp.runs_alloc;
+		source->weights = tmp.weights;
+	}
+
+	if ((uint64) dest->values_num + source->values_num > MEDIAN_MAX_VALUES)
+	{
+		/* Make room for the values by spilling the destination */
+		values_spill(dest, agg_context);
+	}
+
+	/* See medianitems_copy() */
+	if (values_sorted_num(source) == source->values_num &&
+		values_sorted_num(dest) == dest->values_num)
+	{
+		for (int i = 0; i < source->runs_num; i++)
+			values_add_run(dest, dest->values_num + source->run_ends[i],
+						   agg_context);
+	}
+
+	/* Enlarge values[] if needed */
+	values_reserve(dest, source->values_num);
+
+	/*
+	 * By-reference Datums are in agg_context as well, so only the pointers
+	 * to them are moved
+	 */
+	memcpy((char *) dest->values.ptr + dest->values_num * value_size,
+		   source->values.ptr, source->values_num * value_size);
+	if (dest->weights != NULL)
+	{
+		memcpy(dest->weights + dest->values_num, source->weights,
+			   source->values_num * sizeof(uint64));
+		dest->weights_total += source->weights_total;
+	}
+	dest->values_num += source->values_num;
+	dest->values_bytes += source->values_bytes;
+
+	arena_adopt(source, dest);
+
+	if (!values_is_inline(source))
+		pfree(source->values.ptr);
+	if (source->run_ends != NULL)
+		pfree(source->run_ends);
+	if (source->weights != NULL)
+		pfree(source->weights);
+	pfree(source);
+
+	if (values_exceed_work_mem(dest))
+		values_spill(dest, agg_context);
+	else
+		values_trim(dest);
+}
+
+/*
+ * Combine state2 into state1, either of which may be NULL, and return the
+ * combined state, allocated in agg_context.
+ */
+static MedianState *
+median_state_combine(MedianState * state1, MedianState * state2,
+					 MemoryContext agg_context)
+{
+	if (state2 == NULL)
+		return state1;
+
+	/*
+	 * A deserialized state2 in agg_context is taken over rather than copied,
+	 * as nothing uses it afterwards
+	 */
+	if (state2->deserialized && GetMemoryChunkContext(state2) == agg_context)
+	{
+		state2->deserialized = false;
+		if (state1 == NULL)
+			return state2;
+
+		fractions_copy(state2, state1, agg_context);
+		stats_combine(state2, state1);
+		if (state1->counts != NULL || state2->counts != NULL)
+			counts_combine(state2, state1, agg_context);
+		else
+			medianitems_move(state2, state1, agg_context);
+		return state1;
+	}
+
+	/* Manually copy all fields from state2 to state1 */
+	if (state1 == NULL)
+	{
+		MemoryContext old_context;
+
+		old_context = MemoryContextSwitchTo(agg_context);
+
+		state1 = (MedianState *) palloc(sizeof(MedianState));
+		state1->type = state2->type;
+		state1->collation = state2->collation;
+
+		state1->agg_context = agg_context;
+		state1->values_alloc = MEDIAN_INLINE_VALUES;
+		state1->values_num = 0;
+		state1->values.ptr = state1->values_inline;
+		state1->values_bytes = 0;
+
+		state1->arena = NULL;
+		state1->arena_used = 0;
+
+		state1->run_ends = NULL;
+		state1->runs_num = 0;
+		state1->runs_alloc = 0;
+
+		state1->weights = NULL;
+		state1->weights_total = 0;
+		state1->values_repeats = 0;
+
+		state1->spill_file = NULL;
+		state1->spill_weights = NULL;
+		state1->spill_num = 0;
+		state1->spill_bytes = 0;
+		state1->spill_sample = NULL;
+		state1->spill_sample_num = 0;
+		state1->spill_sample_alloc = 0;
+		state1->spill_sample_seed = UINT64CONST(0x9E3779B97F4A7C15);
+		state1->spill_sample_next = 0;
+		state1->spill_sample_w = 0;
+
+		state1->counts = NULL;
+		state1->counts_alloc = 0;
+		state1->counts_num = 0;
+		state1->counts_total = 0;
+
+		state1->fractions = NULL;
+		state1->fractions_num = 0;
+		state1->fractions_bounds = NULL;
+		state1->fractions_ndim = 0;
+
+		state1->deserialized = false;
+		state1->stats = median_track_stats ?
+			palloc0(sizeof(MedianStats)) : NULL;
+
+		MemoryContextSwitchTo(old_context);
+	}
+
+	fractions_copy(state2, state1, agg_context);
+	stats_combine(state2, state1);
+	if (state1->counts != NULL || state2->counts != NULL)
+		counts_combine(state2, state1, agg_context);
+	else if (state2->values_num > 0 || state2->spill_num > 0)
+		medianitems_copy(state2, state1, agg_context);
+
+	return state1;
+}
+
+/*
+ * Median combine function.
+ */
+Datum
+median_combinefn(PG_FUNCTION_ARGS)
+{
+	MedianState *state1;
+	MedianState *state2;
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_combinefn called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (MedianState *) PG_GETARG_POINTER(1);
+
+	PG_RETURN_POINTER(median_state_combine(state1, state2, agg_context));
+}
+
+/*
+ * Serialized states start with a header: the magic number, the version of
+ * the format, the format of the values, flags, and the argument type and the
+ * collation of the state.  The routines of the type are looked up again by
+ * the deserialize function rather than sent, so that a state doesn't depend
+ * on anything but the type and can be stored as median_state and read back
+ * later.
+ *
+ * The type and the collation are identified by their OIDs, which only stay
+ * the same for built-in ones.  States of other types or collations can't be
+ * read after a dump and restore or on another server where the OIDs differ:
+ * they are rejected if the type doesn't exist, and misread if the OID
+ * belongs to another type.
+ *
+ * Native values and Datums of by-value types are sent as a raw block copied
+ * from the values array, so such states can only be read by a server with
+ * the same byte order and Datum width, which the flags record.  Values of
+ * other types are sent using the type's send function.  States keeping
+ * counts send their distinct values along with the counts, and sketches of
+ * approx_median() send the levels of the sketch.
+ */
+#define MEDIAN_SERIAL_MAGIC		0x4D454453	/* "MEDS" */
+#define MEDIAN_SERIAL_VERSION	1
+
+typedef enum MedianSerialFormat
+{
+	MEDIAN_SERIAL_SEND = 1,		/* values prefixed by their length */
+	MEDIAN_SERIAL_RAW = 2,		/* raw block of the values array */
+	MEDIAN_SERIAL_COUNTS = 3,	/* pairs of distinct values and counts */
+	MEDIAN_SERIAL_SKETCH = 4	/* levels of a KLL sketch */
+}	MedianSerialFormat;
+
+/* Flags of a serialized state */
+#define MEDIAN_SERIAL_SORTED	0x01	/* the values are sorted */
+#define MEDIAN_SERIAL_WEIGHTED	0x02	/* weights follow the values */
+#define MEDIAN_SERIAL_FRACTIONS 0x04	/* fractions of percentiles() */
+#define MEDIAN_SERIAL_BIG_ENDIAN 0x08	/* layout of the raw block */
+#define MEDIAN_SERIAL_DATUM8	0x10
+#define MEDIAN_SERIAL_LAYOUT	(MEDIAN_SERIAL_BIG_ENDIAN | MEDIAN_SERIAL_DATUM8)
+#define MEDIAN_SERIAL_ALL_FLAGS	0x1F
+
+/* Header of a serialized state */
+typedef struct MedianSerialHeader
+{
+	MedianSerialFormat format;
+	int			flags;
+	Oid			arg_type;
+	Oid			collation;
+}	MedianSerialHeader;
+
+/*
+ * Flags describing the layout of raw blocks written by this server.
+ */
+static inline int
+serial_layout_flags(void)
+{
+	int			flags = 0;
+
+#ifdef WORDS_BIGENDIAN
+	flags |= MEDIAN_SERIAL_BIG_ENDIAN;
+#endif
+	if (sizeof(Datum) == 8)
+		flags |= MEDIAN_SERIAL_DATUM8;
+
+	return flags;
+}
+
+/*
+ * Append the header to the serialized state.
+ */
+static void
+serial_header_send(StringInfo buf, MedianSerialHeader * header)
+{
+	pq_sendint(buf, MEDIAN_SERIAL_MAGIC, 4);
+	pq_sendbyte(buf, MEDIAN_SERIAL_VERSION);
+	pq_sendbyte(buf, header->format);
+	pq_sendbyte(buf, header->flags | serial_layout_flags());
+	pq_sendint(buf, (int) header->arg_type, sizeof(header->arg_type));
+	pq_sendint(buf, (int) header->collation, sizeof(header->collation));
+}
+
+/*
+ * Read and check the header of the serialized state.  Raw blocks are only
+ * accepted in the layout of this server.
+ */
+static void
+serial_header_receive(StringInfo buf, MedianSerialHeader * header)
+{
+	if (buf->len - buf->cursor < 15 ||
+		(uint32) pq_getmsgint(buf, 4) != MEDIAN_SERIAL_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state")));
+
+	if (pq_getmsgbyte(buf) != MEDIAN_SERIAL_VERSION)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("unsupported median state version")));
+
+	header->format = pq_getmsgbyte(buf);
+	header->flags = pq_getmsgbyte(buf);
+	header->arg_type = pq_getmsgint(buf, sizeof(header->arg_type));
+	header->collation = pq_getmsgint(buf, sizeof(header->collation));
+
+	if (header->format < MEDIAN_SERIAL_SEND ||
+		header->format > MEDIAN_SERIAL_SKETCH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("unexpected median state format %d",
+						(int) header->format)));
+
+	if ((header->flags & ~MEDIAN_SERIAL_ALL_FLAGS) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state")));
+
+	if (header->format == MEDIAN_SERIAL_RAW &&
+		(header->flags & MEDIAN_SERIAL_LAYOUT) != serial_layout_flags())
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("median state was serialized by a server of a different architecture")));
+
+	if (!SearchSysCacheExists1(TYPEOID, ObjectIdGetDatum(header->arg_type)))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("type %u of median state does not exist",
+						header->arg_type)));
+}
+
+/*
+ * Check that the number of elements of the given minimal size read next from
+ * the serialized state isn't larger than what's left of it, before anything
+ * is allocated for them.
+ */
+static void
+serial_check_num(StringInfo buf, uint64 num, Size min_size)
+{
+	if (num > (uint64) (buf->len - buf->cursor) / min_size)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state")));
+}
+
+/*
+ * Check that a count or weight read from the serialized state stands for at
+ * least one value, and that adding it to the total of the state, which
+ * stands for all the values so far, doesn't overflow.
+ */
+static void
+serial_check_weight(uint64 weight, uint64 total)
+{
+	if (weight == 0 || weight > PG_UINT64_MAX - total)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state")));
+}
+
+/*
+ * Choose the format used to serialize values of the state.
+ */
+static inline MedianSerialFormat
+serial_format_for_state(MedianState * state)
+{
+	if (state->counts != NULL)
+		return MEDIAN_SERIAL_COUNTS;
+	if (state->type->values_kind != MEDIAN_VALUES_DATUM ||
+		state->type->arg_typbyval)
+		return MEDIAN_SERIAL_RAW;
+	return MEDIAN_SERIAL_SEND;
+}
+
+/*
+ * Append a value to the serialized state using the type's send function.
+ */
+static void
+datum_send(StringInfo buf, FmgrInfo *send_finfo, Datum val)
+{
+	bytea	   *outputbytes;
+
+	outputbytes = SendFunctionCall(send_finfo, val);
+
+	pq_sendint(buf, VARSIZE(outputbytes) - VARHDRSZ, 4);
+	pq_sendbytes(buf, VARDATA(outputbytes), VARSIZE(outputbytes) - VARHDRSZ);
+
+	pfree(outputbytes);
+}
+
+/*
+ * Read a value from the serialized state using the type's receive function.
+ * The value is passed to the function in the scratch buffer, which is reused
+ * for all the values of the state.
+ */
+static Datum
+datum_receive(StringInfo buf, FmgrInfo *recv_finfo, Oid typioparam,
+			  StringInfo scratch)
+{
+	int			value_len = pq_getmsgint(buf, 4);
+	const char *value_data = pq_getmsgbytes(buf, value_len);
+
+	resetStringInfo(scratch);
+	appendBinaryStringInfo(scratch, value_data, value_len);
+
+	return ReceiveFunctionCall(recv_finfo, scratch, typioparam, -1);
+}
+
+/*
+ * Set up a read-only StringInfo over the serialized state, so that it's
+ * parsed in place rather than copied first.
+ */
+static void
+serial_buffer_init(StringInfo buf, bytea *sstate)
+{
+	buf->data = VARDATA_ANY(sstate);
+	buf->len = VARSIZE_ANY_EXHDR(sstate);
+	buf->maxlen = 0;
+	buf->cursor = 0;
+}
+
+/*
+ * Serialize the state into the versioned format.
+ */
+static bytea *
+median_state_serialize(MedianState * state)
+{
+	MedianSerialFormat format;
+	MedianSerialHeader header;
+	bool		sorted;
+	StringInfoData buf;
+	MedianValuesScan scan;
+	Datum		val;
+	uint64		weight;
+	instr_time	start;
+	bytea	   *result;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	format = serial_format_for_state(state);
+
+	/*
+	 * Sort the values, so that the parallel workers do the sorting, and the
+	 * final function only needs to search the sorted runs.  Sorting brings
+	 * equal weighted values together, which are then sent once.  Spilled
+	 * values are sent as they are, and counts have no values to sort.
+	 */
+	sorted = state->spill_file == NULL && format != MEDIAN_SERIAL_COUNTS;
+	if (sorted)
+	{
+		values_sort(state);
+		if (state->weights != NULL)
+			values_compress(state);
+	}
+
+	pq_begintypsend(&buf);
+
+	header.format = format;
+	header.flags = (sorted ? MEDIAN_SERIAL_SORTED : 0) |
+		(state->weights != NULL ? MEDIAN_SERIAL_WEIGHTED : 0) |
+		(state->fractions != NULL ? MEDIAN_SERIAL_FRACTIONS : 0);
+	header.arg_type = state->type->arg_type;
+	header.collation = state->collation;
+	serial_header_send(&buf, &header);
+
+	/* The fractions of percentiles(), after the bounds of their array */
+	if (state->fractions != NULL)
+	{
+		pq_sendint(&buf, state->fractions_ndim, sizeof(state->fractions_ndim));
+		for (int i = 0; i < 2 * state->fractions_ndim; i++)
+			pq_sendint(&buf, state->fractions_bounds[i], sizeof(int));
+		for (int i = 0; i < state->fractions_num; i++)
+			pq_sendfloat8(&buf, state->fractions[i]);
+	}
+
+	/* For values_alloc and values_num use same value */
+	pq_sendint(&buf, (int) (state->spill_num + state->values_num),
+			   sizeof(state->values_num));
+
+	if (format == MEDIAN_SERIAL_COUNTS)
+	{
+		pq_sendint(&buf, (int) state->counts_num, sizeof(state->counts_num));
+		for (uint32 i = 0; i < state->counts_alloc; i++)
+		{
+			if (state->counts[i].count == 0)
+				continue;
+			pq_sendint64(&buf, state->counts[i].value);
+			pq_sendint64(&buf, state->counts[i].count);
+		}
+	}
+	else if (format == MEDIAN_SERIAL_RAW)
+	{
+		Size		value_size = MEDIAN_VALUE_SIZE(state);
+		uint64		values_size = (state->spill_num + state->values_num) *
+			value_size;
+
+		if (values_size >= MaxAllocSize)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("median state is too large to be serialized")));
+
+		/*
+		 * The temporary file holds values in the same representation as the
+		 * values array, so both are copied as a whole.
+		 */
+		enlargeStringInfo(&buf, (int) values_size);
+		if (state->spill_file != NULL)
+		{
+			spill_seek(state->spill_file, SEEK_SET);
+			spill_read(state->spill_file, buf.data + buf.len,
+					   state->spill_num * value_size);
+			buf.len += state->spill_num * value_size;
+		}
+		pq_sendbytes(&buf, state->values.ptr, state->values_num * value_size);
+	}
+	else
+	{
+		FmgrInfo   *send_finfo = typedesc_send_finfo(state->type);
+
+		values_scan_begin(&scan, state);
+		while (values_scan_next(&scan, &val, &weight))
+			datum_send(&buf, send_finfo, val);
+		values_scan_end(&scan);
+	}
+
+	/* Weights follow the values as a raw block, the same way */
+	if (state->weights != NULL)
+	{
+		uint64		weights_size = (state->spill_num + state->values_num) *
+			sizeof(uint64);
+
+		if ((uint64) buf.len + weights_size >= MaxAllocSize)
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("median state is too large to be serialized")));
+
+		enlargeStringInfo(&buf, (int) weights_size);
+		if (state->spill_weights != NULL)
+		{
+			spill_seek(state->spill_weights, SEEK_SET);
+			spill_read(state->spill_weights, buf.data + buf.len,
+					   state->spill_num * sizeof(uint64));
+			buf.len += state->spill_num * sizeof(uint64);
+		}
+		pq_sendbytes(&buf, (char *) state->weights,
+					 state->values_num * sizeof(uint64));
+	}
+
+	result = pq_endtypsend(&buf);
+
+	/* The partial state isn't finalized, so it is reported here */
+	if (state->stats != NULL)
+	{
+		instr_time	elapsed;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		elog(DEBUG1, "median: partial state of " UINT64_FORMAT " values, "
+			 UINT64_FORMAT " resizes, " UINT64_FORMAT " spills, "
+			 "serialized into %u bytes in %.3f ms",
+			 values_total(state), state->stats->resizes, state->stats->spills,
+			 (uint32) VARSIZE(result) - VARHDRSZ,
+			 INSTR_TIME_GET_MILLISEC(elapsed));
+	}
+
+	return result;
+}
+
+/*
+ * Median serialize function.
+ */
+Datum
+median_serializefn(PG_FUNCTION_ARGS)
+{
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "median_serializefn called in non-aggregate context");
+
+	PG_RETURN_BYTEA_P(median_state_serialize((MedianState *) PG_GETARG_POINTER(0)));
+}
+
+/*
+ * Deserialize the state.  It's built in the given memory context, which for
+ * the deserialize function is the aggregate memory context, so that the
+ * combine function can take it over.  The type descriptor is cached in
+ * fn_extra of the given function, if there's one.
+ */
+static MedianState *
+median_state_deserialize(bytea *sstate, FmgrInfo *flinfo,
+						 MemoryContext agg_context)
+{
+	MedianState *result;
+	MedianSerialHeader header;
+	StringInfoData buf;
+	MemoryContext old_context;
+	bool		weighted;
+	instr_time	start;
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	serial_buffer_init(&buf, sstate);
+
+	/*
+	 * Build the state in agg_context, so that the combine function can take
+	 * it over
+	 */
+	old_context = MemoryContextSwitchTo(agg_context);
+
+	result = (MedianState *) palloc(sizeof(MedianState));
+
+	serial_header_receive(&buf, &header);
+	result->type = typedesc_get(flinfo, header.arg_type);
+	result->collation = header.collation;
+
+	/* Counts are only kept for integers, other formats follow from the type */
+	result->counts = NULL;
+	if (header.format == MEDIAN_SERIAL_COUNTS ?
+		result->type->values_kind != MEDIAN_VALUES_INT64 :
+		header.format != serial_format_for_state(result))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("unexpected median state format %d",
+						(int) header.format)));
+
+	/*
+	 * Counts hold neither values nor weights, only the fractions of
+	 * percentiles() come along with them
+	 */
+	if (header.format == MEDIAN_SERIAL_COUNTS &&
+		(header.flags & (MEDIAN_SERIAL_SORTED | MEDIAN_SERIAL_WEIGHTED)) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state")));
+
+	if (header.flags & MEDIAN_SERIAL_FRACTIONS)
+	{
+		int			ndim = pq_getmsgint(&buf, sizeof(ndim));
+		int			bounds[2 * MAXDIM];
+
+		if (ndim < 0 || ndim > MAXDIM)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid median state")));
+		for (int i = 0; i < 2 * ndim; i++)
+			bounds[i] = pq_getmsgint(&buf, sizeof(int));
+		for (int i = 0; i < ndim; i++)
+		{
+			if (bounds[i] < 0 || bounds[ndim + i] > PG_INT32_MAX - bounds[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+						 errmsg("invalid median state")));
+		}
+
+		fractions_alloc(result, ArrayGetNItems(ndim, bounds), ndim,
+						CurrentMemoryContext);
+		memcpy(result->fractions_bounds, bounds, 2 * ndim * sizeof(int));
+		serial_check_num(&buf, result->fractions_num, sizeof(float8));
+		for (int i = 0; i < result->fractions_num; i++)
+			result->fractions[i] = pq_getmsgfloat8(&buf);
+	}
+	else
+	{
+		result->fractions = NULL;
+		result->fractions_num = 0;
+		result->fractions_bounds = NULL;
+		result->fractions_ndim = 0;
+	}
+
+	result->agg_context = agg_context;
+	result->values_num = pq_getmsgint(&buf, sizeof(result->values_num));
+	if (header.format == MEDIAN_SERIAL_COUNTS && result->values_num != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid median state")));
+	serial_check_num(&buf, result->values_num,
+					 header.format == MEDIAN_SERIAL_RAW ?
+					 MEDIAN_VALUE_SIZE(result) : sizeof(int32));
+	if (result->values_num > MEDIAN_INLINE_VALUES)
+	{
+		result->values_alloc = result->values_num;
+		result->values.ptr = palloc(result->values_alloc *
+									MEDIAN_VALUE_SIZE(result));
+	}
+	else
+	{
+		result->values_alloc = MEDIAN_INLINE_VALUES;
+		result->values.ptr = result->values_inline;
+	}
+	result->values_bytes = 0;
+
+	result->arena = NULL;
+	result->arena_used = 0;
+
+	/* The values of the partial state are sorted, unless it spilled */
+	result->run_ends = NULL;
+	result->runs_num = 0;
+	result->runs_alloc = 0;
+	if ((header.flags & MEDIAN_SERIAL_SORTED) && result->values_num > 0)
+		values_add_run(result, result->values_num, CurrentMemoryContext);
+
+	weighted = (header.flags & MEDIAN_SERIAL_WEIGHTED) != 0;
+	result->weights = NULL;
+	result->weights_total = 0;
+	result->values_repeats = 0;
+
+	result->spill_file = NULL;
+	result->spill_weights = NULL;
+	result->spill_num = 0;
+	result->spill_bytes = 0;
+	result->spill_sample = NULL;
+	result->spill_sample_num = 0;
+	result->spill_sample_alloc = 0;
+	result->spill_sample_seed = UINT64CONST(0x9E3779B97F4A7C15);
+	result->spill_sample_next = 0;
+	result->spill_sample_w = 0;
+
+	result->counts = NULL;
+	result->counts_alloc = 0;
+	result->counts_num = 0;
+	result->counts_total = 0;
+
+	result->deserialized = true;
+	result->stats = median_track_stats ? palloc0(sizeof(MedianStats)) : NULL;
+
+	if (header.format == MEDIAN_SERIAL_COUNTS)
+	{
+		uint32		counts_num = pq_getmsgint(&buf, sizeof(counts_num));
+
+		serial_check_num(&buf, counts_num, 2 * sizeof(int64));
+		if (counts_num > COUNTS_MAX_ALLOC / 2)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid median state")));
+		counts_reserve(result, counts_num, agg_context);
+		for (uint32 i = 0; i < counts_num; i++)
+		{
+			int64		value = pq_getmsgint64(&buf);
+			uint64		count = (uint64) pq_getmsgint64(&buf);
+
+			serial_check_weight(count, result->counts_total);
+			counts_add(result, value, count, agg_context);
+		}
+	}
+	else if (header.format == MEDIAN_SERIAL_RAW)
+	{
+		Size		values_size = result->values_num * MEDIAN_VALUE_SIZE(result);
+
+		memcpy(result->values.ptr, pq_getmsgbytes(&buf, values_size),
+			   values_size);
+	}
+	else
+	{
+		FmgrInfo   *recv_finfo = typedesc_recv_finfo(result->type);
+		StringInfoData value_buf;
+
+		initStringInfo(&value_buf);
+		for (int i = 0; i < result->values_num; i++)
+		{
+			Datum		val = datum_receive(&buf, recv_finfo,
+											result->type->arg_typioparam,
+											&value_buf);
+
+			switch (result->type->values_kind)
+			{
+				case MEDIAN_VALUES_INT64:
+					result->values.ints[i] =
+						datum_get_int64(result->type->arg_typlen, val);
+					break;
+				case MEDIAN_VALUES_FLOAT8:
+					result->values.floats[i] =
+						datum_get_float8(result->type->arg_typlen, val);
+					break;
+				default:
+					/* Values of by-reference types are moved into chunks */
+					result->values.datums[i] = values_copy_datum(result, val);
+					pfree(DatumGetPointer(val));
+					break;
+			}
+		}
+		pfree(value_buf.data);
+	}
+
+	if (weighted)
+	{
+		Size		weights_size = result->values_num * sizeof(uint64);
+
+		result->weights = palloc(result->values_alloc * sizeof(uint64));
+		memcpy(result->weights, pq_getmsgbytes(&buf, weights_size),
+			   weights_size);
+		for (uint32 i = 0; i < result->values_num; i++)
+		{
+			serial_check_weight(result->weights[i], result->weights_total);
+			result->weights_total += result->weights[i];
+		}
+	}
+
+	pq_getmsgend(&buf);
+
+	if (result->stats != NULL)
+	{
+		instr_time	elapsed;
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		result->stats->deserialized_bytes = VARSIZE_ANY_EXHDR(sstate);
+		result->stats->deserialize_ms = INSTR_TIME_GET_MILLISEC(elapsed);
+	}
+
+	MemoryContextSwitchTo(old_context);
+
+	return result;
+}
+
+/*
+ * Median deserialize function.
+ */
+Datum
+median_deserializefn(PG_FUNCTION_ARGS)
+{
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_deserializefn called in non-aggregate context");
+
+	PG_RETURN_POINTER(median_state_deserialize(PG_GETARG_BYTEA_PP(0),
+											   fcinfo->flinfo, agg_context));
+}
+
+/*
+ * Initialize type information of the given argument type.  The comparison
+ * function, if it's needed, is set up in the given memory context.
+ */
+static void
+typeinfo_init(MedianTypeInfo * info, Oid arg_type, Oid collation,
+			  MemoryContext context)
+{
+	info->arg_type = arg_type;
+	get_typlenbyval(arg_type, &info->arg_typlen, &info->arg_typbyval);
+	info->values_kind = values_kind_for_type(arg_type);
+
+	if (info->values_kind == MEDIAN_VALUES_DATUM)
+	{
+		TypeCacheEntry *typentry;
+
+		typentry = lookup_type_cache(arg_type, TYPECACHE_CMP_PROC);
+		if (!OidIsValid(typentry->cmp_proc))
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_FUNCTION),
+			   errmsg("could not identify a comparison function for type %s",
+					  format_type_be(arg_type))));
+		fmgr_info_cxt(typentry->cmp_proc, &info->ctx.cmp_finfo, context);
+		info->ctx.collation = collation;
+	}
+}
+
+/*
+ * Initialize type information from the type descriptor of a state, without
+ * looking the type up again.
+ */
+static void
+typeinfo_from_desc(MedianTypeInfo * info, MedianTypeDesc * desc,
+				   Oid collation)
+{
+	info->arg_type = desc->arg_type;
+	info->arg_typbyval = desc->arg_typbyval;
+	info->arg_typlen = desc->arg_typlen;
+	info->values_kind = desc->values_kind;
+
+	if (info->values_kind == MEDIAN_VALUES_DATUM)
+	{
+		fmgr_info_copy(&info->ctx.cmp_finfo, &desc->cmp_finfo,
+					   CurrentMemoryContext);
+		info->ctx.collation = collation;
+	}
+}
+
+/*
+ * Compare two datums of the argument type.
+ */
+static inline int
+typeinfo_compare(MedianTypeInfo * info, Datum val1, Datum val2)
+{
+	switch (info->values_kind)
+	{
+		case MEDIAN_VALUES_INT64:
+			{
+				int64		a = datum_get_int64(info->arg_typlen, val1);
+				int64		b = datum_get_int64(info->arg_typlen, val2);
+
+				return (a > b) - (a < b);
+			}
+		case MEDIAN_VALUES_FLOAT8:
+			return float8_compare(datum_get_float8(info->arg_typlen, val1),
+								  datum_get_float8(info->arg_typlen, val2));
+		default:
+			return values_compare(&info->ctx, val1, val2);
+	}
+}
+
+/*
+ * Copy a datum of the argument type into the current memory context.
+ */
+static inline Datum
+typeinfo_copy(MedianTypeInfo * info, Datum val)
+{
+	/* Detoast the argument if it's varlena */
+	if (!info->arg_typbyval && info->arg_typlen == -1)
+		return PointerGetDatum(PG_DETOAST_DATUM_COPY(val));
+	return datumCopy(val, info->arg_typbyval, info->arg_typlen);
+}
+
+/*
+ * Free a datum of the argument type made by typeinfo_copy().
+ */
+static inline void
+typeinfo_free(MedianTypeInfo * info, Datum val)
+{
+	if (!info->arg_typbyval)
+		pfree(DatumGetPointer(val));
+}
+
+/*
+ * Comparison function for qsort_arg() over datums of the argument type.
+ */
+static int
+typeinfo_datum_cmp(const void *a, const void *b, void *arg)
+{
+	return typeinfo_compare((MedianTypeInfo *) arg,
+							*((const Datum *) a), *((const Datum *) b));
+}
+
+/*
+ * External selection.
+ *
+ * Once a state spilled its values into a temporary file, the middle elements
+ * are found without sorting the file.  Each pass over the values narrows down
+ * the range of values which contains the wanted rank:
+ *
+ *	1. A random sample of the values within the range is taken, and pivots
+ *	   are picked from it.  The first pass uses the sample taken as the values
+ *	   were spilled, so that it doesn't read the file for it.
+ *
+ *	2. The values within the range are counted per bucket: below the first
+ *	   pivot, equal to a pivot, between two adjacent pivots and above the last
+ *	   pivot.
+ *
+ *	3. If the rank falls into a bucket of values equal to a pivot, the pivot
+ *	   is the answer.  Otherwise the range is narrowed down to the bucket
+ *	   between two pivots.
+ *
+ * Once the values of the range fit into work_mem, they are collected into
+ * memory and the rank is selected among them.
+ *
+ * The rank of a value in the sample estimates its rank in the range, so that
+ * two pivots around the estimated position of the rank, SPILL_BAND_MARGIN
+ * sample positions away from it, bracket the rank with high probability, the
+ * way Floyd-Rivest selection picks its pivots.  If the values between them
+ * are expected to fit into work_mem, they are collected while counting, and
+ * the selection usually takes a single pass.  Otherwise, and for weighted
+ * values whose sample doesn't estimate their ranks, up to SPILL_NUM_PIVOTS
+ * pivots are picked at evenly spaced ranks of the sample, which shrinks the
+ * range about SPILL_NUM_PIVOTS times per pass.
+ */
+
+/*
+ * Distance of the pivots bracketing the rank from its estimated position in
+ * a sample of n values, about four standard deviations of the position
+ */
+#define SPILL_BAND_MARGIN(n)	((uint32) (2 * sqrt((double) (n))) + 1)
+
+/* Range of values which contains the wanted rank */
+typedef struct MedianSpillRange
+{
+	/* Exclusive bounds, a missing bound means the range is unbounded */
+	bool		has_lo;
+	Datum		lo;
+	bool		has_hi;
+	Datum		hi;
+	/* Number of values less than or equal to lo */
+	uint64		offset;
+	/* Number of values within the range */
+	uint64		count;
+	/* Number of elements of the state within the range, weighted or not */
+	uint64		entries;
+}	MedianSpillRange;
+
+static inline bool
+spill_range_contains(MedianTypeInfo * info, MedianSpillRange * range,
+					 Datum val)
+{
+	return (!range->has_lo || typeinfo_compare(info, val, range->lo) > 0) &&
+		(!range->has_hi || typeinfo_compare(info, val, range->hi) < 0);
+}
+
+/*
+ * Return the bucket of the value: 2 * i for values between pivot i - 1 and
+ * pivot i, 2 * i + 1 for values equal to pivot i.
+ */
+static inline int
+spill_bucket(MedianTypeInfo * info, Datum *pivots, int npivots, Datum val)
+{
+	int			lo = 0;
+	int			hi = npivots;
+
+	while (lo < hi)
+	{
+		int			mid = lo + (hi - lo) / 2;
+		int			cmp = typeinfo_compare(info, val, pivots[mid]);
+
+		if (cmp == 0)
+			return 2 * mid + 1;
+		else if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return 2 * lo;
+}
+
+/*
+ * Add a copy of the value to a reservoir sample of SPILL_SAMPLE_SIZE values,
+ * seen being the number of values offered to the sample before.
+ */
+static inline void
+spill_sample_offer(MedianTypeInfo * info, Datum *sample, int *nsample,
+				   uint64 seen, uint64 *seed, Datum val)
+{
+	uint64		i;
+
+	if (*nsample < SPILL_SAMPLE_SIZE)
+	{
+		sample[(*nsample)++] = typeinfo_copy(info, val);
+		return;
+	}
+
+	i = spill_random(seed) % (seen + 1);
+	if (i < SPILL_SAMPLE_SIZE)
+	{
+		typeinfo_free(info, sample[i]);
+		sample[i] = typeinfo_copy(info, val);
+	}
+}
+
+/*
+ * Return a sorted random sample of the values, made of the sample taken as
+ * they were spilled and the values still in memory.  Weighted values are
+ * sampled once each, so that the pivots split the elements to collect into
+ * memory.
+ */
+static Datum *
+spill_sample_all(MedianState * state, MedianTypeInfo * info, int *nsample)
+{
+	Datum	   *sample = palloc(SPILL_SAMPLE_SIZE * sizeof(Datum));
+	uint64		seed = state->spill_sample_seed;
+
+	*nsample = 0;
+	for (uint32 i = 0; i < state->spill_sample_num; i++)
+		sample[(*nsample)++] = typeinfo_copy(info, state->spill_sample[i]);
+
+	/*
+	 * The reservoir sampling goes on over the values in memory, so that the
+	 * sample stays uniform.  Until the reservoir is full, it holds all the
+	 * values seen.
+	 */
+	for (uint32 i = 0; i < state->values_num; i++)
+	{
+		uint64		seen = state->spill_num + i;
+		uint64		j;
+
+		if (*nsample < SPILL_SAMPLE_SIZE && (uint64) *nsample == seen)
+		{
+			sample[(*nsample)++] = typeinfo_copy(info,
+												 values_get_datum(state, i));
+			continue;
+		}
+
+		j = spill_random(&seed) % (seen + 1);
+		if (j < (uint64) *nsample)
+		{
+			typeinfo_free(info, sample[j]);
+			sample[j] = typeinfo_copy(info, values_get_datum(state, i));
+		}
+	}
+
+	Assert(*nsample > 0);
+	qsort_arg(sample, *nsample, sizeof(Datum), typeinfo_datum_cmp, info);
+
+	return sample;
+}
+
+/*
+ * Return a sorted random sample of the values within the range, taken by
+ * reservoir sampling while reading them.
+ */
+static Datum *
+spill_sample_range(MedianState * state, MedianTypeInfo * info,
+				   MedianSpillRange * range, int *nsample)
+{
+	Datum	   *sample = palloc(SPILL_SAMPLE_SIZE * sizeof(Datum));
+	uint64		seen = 0;
+	uint64		seed = state->spill_sample_seed;
+	MedianValuesScan scan;
+	Datum		val;
+	uint64		weight;
+
+	*nsample = 0;
+	values_scan_begin(&scan, state);
+	while (values_scan_next(&scan, &val, &weight))
+	{
+		if (!spill_range_contains(info, range, val))
+			continue;
+
+		spill_sample_offer(info, sample, nsample, seen++, &seed, val);
+
+		CHECK_FOR_INTERRUPTS();
+	}
+	values_scan_end(&scan);
+
+	Assert(*nsample > 0);
+	qsort_arg(sample, *nsample, sizeof(Datum), typeinfo_datum_cmp, info);
+
+	return sample;
+}
+
+/*
+ * Add a copy of the sample value to the pivots, unless it's equal to the
+ * last one of them.
+ */
+static inline void
+spill_add_pivot(MedianTypeInfo * info, Datum *pivots, int *npivots,
+				Datum pivot)
+{
+	if (*npivots > 0 &&
+		typeinfo_compare(info, pivots[*npivots - 1], pivot) == 0)
+		return;
+	pivots[(*npivots)++] = typeinfo_copy(info, pivot);
+}
+
+/*
+ * Pick up to SPILL_NUM_PIVOTS distinct pivots at evenly spaced ranks of the
+ * sample.  Returns their number.
+ */
+static int
+spill_pick_pivots(MedianTypeInfo * info, Datum *sample, int nsample,
+				  Datum *pivots)
+{
+	int			npivots = 0;
+
+	for (int i = 1; i <= SPILL_NUM_PIVOTS; i++)
+		spill_add_pivot(info, pivots, &npivots,
+						sample[(uint64) i * nsample / (SPILL_NUM_PIVOTS + 1)]);
+
+	return npivots;
+}
+
+/*
+ * Pick the two pivots bracketing the given fraction of the ranks of the
+ * sample, which is missing on a side whose margin falls outside of it.
+ * Returns their number, and the bucket between them in band, or -1 if equal
+ * pivots leave no values between them.
+ */
+static int
+spill_pick_band(MedianTypeInfo * info, Datum *sample, int nsample,
+				double fraction, Datum *pivots, int *band)
+{
+	int64		pos = (int64) (fraction * nsample);
+	int64		margin = SPILL_BAND_MARGIN(nsample);
+	int			npivots = 0;
+
+	if (pos - margin >= 0)
+		spill_add_pivot(info, pivots, &npivots, sample[pos - margin]);
+	*band = 2 * npivots;
+	if (pos + margin < nsample)
+		spill_add_pivot(info, pivots, &npivots, sample[pos + margin]);
+
+	/* Both margins ended up at the same value */
+	if (*band > 0 && npivots == 1 && pos + margin < nsample)
+		*band = -1;
+
+	return npivots;
+}
+
+/*
+ * Set up an empty state to collect the values of the range into, with room
+ * for the given number of values.  It keeps its values in the current memory
+ * context and never spills.
+ */
+static void
+spill_collect_begin(MedianState * state, MedianState * bucket, uint64 alloc)
+{
+	*bucket = *state;
+	bucket->values_alloc = Max(alloc, 1);
+	bucket->values_num = 0;
+	bucket->values_bytes = 0;
+	bucket->arena = NULL;
+	bucket->arena_used = 0;
+	bucket->runs_num = 0;
+	bucket->values.ptr = palloc(bucket->values_alloc *
+								MEDIAN_VALUE_SIZE(bucket));
+	bucket->weights = NULL;
+	bucket->weights_total = 0;
+	if (state->weights != NULL)
+		bucket->weights = palloc(bucket->values_alloc * sizeof(uint64));
+	bucket->values_repeats = 0;
+	bucket->spill_file = NULL;
+	bucket->spill_weights = NULL;
+	bucket->spill_num = 0;
+	bucket->spill_bytes = 0;
+	bucket->spill_sample = NULL;
+	bucket->spill_sample_num = 0;
+	bucket->spill_sample_alloc = 0;
+}
+
+/*
+ * Free the memory of a state set up by spill_collect_begin().
+ */
+static void
+spill_collect_free(MedianState * bucket)
+{
+	arena_reset(bucket);
+	if (bucket->arena != NULL)
+		pfree(bucket->arena);
+	pfree(bucket->values.ptr);
+	if (bucket->weights != NULL)
+		pfree(bucket->weights);
+}
+
+/*
+ * Select the rank among the values of the range collected into memory.
+ */
+static void
+spill_collected_select(MedianState * bucket, Oid collation,
+					   MedianSpillRange * range, uint64 rank, Datum *val,
+					   Datum *next)
+{
+	uint64		k = rank - range->offset;
+	uint32		k_next;
+
+	Assert(bucket->values_num == range->entries);
+
+	/*
+	 * The value next to the last one of the range is its upper bound, which
+	 * is a pivot and hence one of the values.
+	 */
+	if (next != NULL && k + 1 == range->count)
+	{
+		Assert(range->has_hi);
+		*next = range->hi;
+		next = NULL;
+	}
+
+	if (bucket->weights != NULL)
+		values_weighted_select(bucket, collation, k, val, next);
+	else
+	{
+		values_select(bucket, collation, k, next ? &k_next : NULL);
+
+		*val = values_get_datum(bucket, k);
+		if (next != NULL)
+			*next = values_get_datum(bucket, k_next);
+	}
+}
+
+/*
+ * Find the value of the given rank among all the values of a spilled state.
+ * If next isn't NULL, the value of the next rank is returned in it as well.
+ * The returned values are allocated in the current memory context.
+ *
+ * The state isn't modified, so that the final function can be called again.
+ */
+static void
+values_spill_select(MedianState * state, Oid collation, uint64 rank,
+					Datum *val, Datum *next)
+{
+	MedianTypeInfo info;
+	MedianSpillRange range;
+	MedianState collected;
+	bool		have_collected = false;
+	bool		first_pass = true;
+	uint64		avg_size;
+	uint64		max_values;
+	uint64	   *counts = palloc((2 * SPILL_NUM_PIVOTS + 1) * sizeof(uint64));
+	uint64	   *entries = palloc((2 * SPILL_NUM_PIVOTS + 1) * sizeof(uint64));
+
+	typeinfo_from_desc(&info, state->type, collation);
+
+	range.has_lo = false;
+	range.has_hi = false;
+	range.offset = 0;
+	range.count = values_total(state);
+	range.entries = state->spill_num + state->values_num;
+
+	/*
+	 * Number of values which may be collected into memory.  The state itself
+	 * already takes up to work_mem, so the selection needs up to twice as
+	 * much.
+	 */
+	avg_size = MEDIAN_VALUE_SIZE(state) +
+		(state->weights != NULL ? sizeof(uint64) : 0) +
+		(state->spill_bytes + state->values_bytes) / range.entries;
+	max_values = Max((uint64) work_mem * 1024L / avg_size, SPILL_SAMPLE_SIZE);
+	max_values = Min(max_values, MEDIAN_MAX_VALUES);
+
+	for (;;)
+	{
+		Datum	   *sample;
+		int			nsample;
+		Datum	   *pivots;
+		int			npivots;
+		int			band = -1;
+		int			b;
+		uint64		before;
+		MedianValuesScan scan;
+		Datum		cur;
+		uint64		weight;
+
+		if (!have_collected && range.entries <= max_values)
+		{
+			/* Collect the values of the range into memory */
+			spill_collect_begin(state, &collected, range.entries);
+
+			values_scan_begin(&scan, state);
+			while (values_scan_next(&scan, &cur, &weight))
+			{
+				if (spill_range_contains(&info, &range, cur))
+					values_append(&collected, cur, weight);
+			}
+			values_scan_end(&scan);
+
+			have_collected = true;
+		}
+
+		if (have_collected)
+		{
+			spill_collected_select(&collected, collation, &range, rank, val,
+								   next);
+			break;
+		}
+
+		/* Pick the pivots from a sample of the range */
+		if (first_pass)
+			sample = spill_sample_all(state, &info, &nsample);
+		else
+			sample = spill_sample_range(state, &info, &range, &nsample);
+		first_pass = false;
+
+		pivots = palloc(SPILL_NUM_PIVOTS * sizeof(Datum));
+		npivots = 0;
+		if (state->weights == NULL &&
+			range.entries * 2 * SPILL_BAND_MARGIN(nsample) <=
+			max_values / 2 * nsample)
+		{
+			npivots = spill_pick_band(&info, sample, nsample,
+									  (double) (rank - range.offset) /
+									  range.count, pivots, &band);
+			if (band >= 0)
+				spill_collect_begin(state, &collected,
+									Min(range.entries * 4 *
+										SPILL_BAND_MARGIN(nsample) / nsample,
+										max_values));
+		}
+		if (band < 0)
+		{
+			for (int i = 0; i < npivots; i++)
+				typeinfo_free(&info, pivots[i]);
+			npivots = spill_pick_pivots(&info, sample, nsample, pivots);
+		}
+
+		for (int i = 0; i < nsample; i++)
+			typeinfo_free(&info, sample[i]);
+		pfree(sample);
+
+		/*
+		 * Count the values of the range per bucket, collecting the ones
+		 * between the pivots bracketing the rank while they fit into memory
+		 */
+		memset(counts, 0, (2 * npivots + 1) * sizeof(uint64));
+		memset(entries, 0, (2 * npivots + 1) * sizeof(uint64));
+
+		values_scan_begin(&scan, state);
+		while (values_scan_next(&scan, &cur, &weight))
+		{
+			if (spill_range_contains(&info, &range, cur))
+			{
+				b = spill_bucket(&info, pivots, npivots, cur);
+				counts[b] += weight;
+				entries[b]++;
+
+				if (b == band)
+				{
+					if (collected.values_num < max_values)
+						values_append(&collected, cur, weight);
+					else
+					{
+						spill_collect_free(&collected);
+						band = -1;
+					}
+				}
+			}
+
+			CHECK_FOR_INTERRUPTS();
+		}
+		values_scan_end(&scan);
+
+		/* Find the bucket the rank falls into */
+		before = 0;
+		for (b = 0; rank - range.offset >= before + counts[b]; b++)
+			before += counts[b];
+
+		if (b % 2 == 1)
+		{
+			/* The value is equal to a pivot */
+			*val = pivots[b / 2];
+			if (next == NULL)
+				break;
+
+			if (rank + 1 - range.offset < before + counts[b])
+			{
+				*next = pivots[b / 2];
+				break;
+			}
+
+			/*
+			 * The next value is the smallest value above the pivot.  It's
+			 * either the next pivot or a value between them.
+			 */
+			before += counts[b];
+			b++;
+			rank++;
+			val = next;
+			next = NULL;
+
+			if (counts[b] == 0)
+			{
+				Assert(b / 2 < npivots);
+				*val = pivots[b / 2];
+				break;
+			}
+		}
+
+		/* Narrow the range down to the bucket between pivots */
+		if (b / 2 > 0)
+		{
+			range.has_lo = true;
+			range.lo = pivots[b / 2 - 1];
+		}
+		if (b / 2 < npivots)
+		{
+			range.has_hi = true;
+			range.hi = pivots[b / 2];
+		}
+		range.offset += before;
+		range.count = counts[b];
+		range.entries = entries[b];
+
+		/* The values of the bucket may have been collected already */
+		if (band >= 0)
+		{
+			if (b == band)
+				have_collected = true;
+			else
+				spill_collect_free(&collected);
+		}
+	}
+
+	pfree(counts);
+	pfree(entries);
+}
+
+/*
+ * Selection across sorted runs.
+ *
+ * When the values array consists of sorted runs only, as it does once sorted
+ * partial states of parallel workers were combined, the value of a given rank
+ * is found without moving any values.  Each run keeps a window of values
+ * which may still hold the rank.  Every step picks the weighted median of the
+ * middle values of the windows as the pivot and counts the values less than
+ * and equal to it by binary search within each window.  Either the pivot is
+ * the answer, or the parts of the windows on the wrong side of it are
+ * discarded.  A step discards at least a quarter of the remaining values, so
+ * that the selection takes O(r log^2 n) comparisons for r runs.
+ *
+ * Weighted values are counted by their weights, using the running totals of
+ * the weights, so that weighted partial states are searched the same way.
+ */
+
+/* Middle value of a window, weighted by the size of the window */
+typedef struct MedianRunPivot
+{
+	Datum		value;
+	uint64		weight;
+}	MedianRunPivot;
+
+static int
+run_pivot_cmp(const void *a, const void *b, void *arg)
+{
+	return typeinfo_compare((MedianTypeInfo *) arg,
+							((const MedianRunPivot *) a)->value,
+							((const MedianRunPivot *) b)->value);
+}
+
+/*
+ * Number of values values[lo..hi - 1] stand for.  totals holds the running
+ * totals of the weights, or is NULL if the values aren't weighted.
+ */
+static inline uint64
+run_weight(const uint64 *totals, uint32 lo, uint32 hi)
+{
+	if (totals == NULL || lo >= hi)
+		return hi - lo;
+	return totals[hi - 1] - (lo > 0 ? totals[lo - 1] : 0);
+}
+
+/*
+ * Return the first position within values[lo..hi - 1] holding a value
+ * greater than or equal to the given one, or greater than it if upper is
+ * true.
+ */
+static uint32
+run_search(MedianState * state, MedianTypeInfo * info, uint32 lo, uint32 hi,
+		   Datum val, bool upper)
+{
+	while (lo < hi)
+	{
+		uint32		mid = lo + (hi - lo) / 2;
+		int			cmp = typeinfo_compare(info, values_get_datum(state, mid),
+										   val);
+
+		if (cmp < 0 || (upper && cmp == 0))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Return the value of the given rank among the sorted runs.  The arrays are
+ * workspace of runs_num elements each.
+ */
+static Datum
+runs_select_rank(MedianState * state, MedianTypeInfo * info,
+				 const uint64 *totals, uint64 rank, uint32 *lo, uint32 *hi,
+				 uint32 *less, uint32 *less_equal, MedianRunPivot * pivots)
+{
+	for (int i = 0; i < state->runs_num; i++)
+	{
+		lo[i] = i == 0 ? 0 : state->run_ends[i - 1];
+		hi[i] = state->run_ends[i];
+	}
+
+	for (;;)
+	{
+		int			npivots = 0;
+		int			p;
+		uint64		total = 0;
+		uint64		weight = 0;
+		uint64		less_num = 0;
+		uint64		equal_num = 0;
+		Datum		pivot;
+
+		/* Pick the weighted median of the middle values of the windows */
+		for (int i = 0; i < state->runs_num; i++)
+		{
+			if (lo[i] >= hi[i])
+				continue;
+
+			pivots[npivots].value = values_get_datum(state,
+													 lo[i] + (hi[i] - lo[i]) / 2);
+			pivots[npivots].weight = run_weight(totals, lo[i], hi[i]);
+			total += pivots[npivots].weight;
+			npivots++;
+		}
+
+		Assert(npivots > 0);
+		qsort_arg(pivots, npivots, sizeof(MedianRunPivot), run_pivot_cmp, info);
+
+		for (p = 0; p < npivots - 1; p++)
+		{
+			weight += pivots[p].weight;
+			if (2 * weight >= total)
+				break;
+		}
+		pivot = pivots[p].value;
+
+		/* Count the values less than and equal to the pivot */
+		for (int i = 0; i < state->runs_num; i++)
+		{
+			less[i] = run_search(state, info, lo[i], hi[i], pivot, false);
+			less_equal[i] = run_search(state, info, less[i], hi[i], pivot, true);
+
+			less_num += run_weight(totals, lo[i], less[i]);
+			equal_num += run_weight(totals, less[i], less_equal[i]);
+		}
+
+		if (rank < less_num)
+		{
+			for (int i = 0; i < state->runs_num; i++)
+				hi[i] = less[i];
+		}
+		else if (rank < less_num + equal_num)
+			return pivot;
+		else
+		{
+			rank -= less_num + equal_num;
+			for (int i = 0; i < state->runs_num; i++)
+				lo[i] = less_equal[i];
+		}
+
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Return the value of the given rank of a single weighted run, found by
+ * binary search over the running totals of its weights.
+ */
+static Datum
+run_select_weighted(MedianState * state, const uint64 *totals, uint64 rank)
+{
+	uint32		lo = 0;
+	uint32		hi = state->values_num - 1;
+
+	while (lo < hi)
+	{
+		uint32		mid = lo + (hi - lo) / 2;
+
+		if (totals[mid] <= rank)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return values_get_datum(state, lo);
+}
+
+/*
+ * Find the value of the given rank among the sorted runs of the values array.
+ * If next isn't NULL, the value of the next rank is returned in it as well.
+ *
+ * The state isn't modified, so that the final function can be called again.
+ */
+static void
+values_runs_select(MedianState * state, Oid collation, uint64 rank,
+				   Datum *val, Datum *next)
+{
+	MedianTypeInfo info;
+	uint64	   *totals = NULL;
+	uint32	   *lo;
+	uint32	   *hi;
+	uint32	   *less;
+	uint32	   *less_equal;
+	MedianRunPivot *pivots;
+
+	Assert(values_all_sorted(state));
+
+	/* A single run is simply indexed */
+	if (state->runs_num == 1 && state->weights == NULL)
+	{
+		*val = values_get_datum(state, rank);
+		if (next != NULL)
+			*next = values_get_datum(state, rank + 1);
+		return;
+	}
+
+	if (state->weights != NULL)
+	{
+		uint64		total = 0;
+
+		totals = palloc(state->values_num * sizeof(uint64));
+		for (uint32 i = 0; i < state->values_num; i++)
+		{
+			total += state->weights[i];
+			totals[i] = total;
+		}
+
+		if (state->runs_num == 1)
+		{
+			*val = run_select_weighted(state, totals, rank);
+			if (next != NULL)
+				*next = run_select_weighted(state, totals, rank + 1);
+			pfree(totals);
+			return;
+		}
+	}
+
+	typeinfo_from_desc(&info, state->type, collation);
+
+	lo = palloc(state->runs_num * sizeof(uint32));
+	hi = palloc(state->runs_num * sizeof(uint32));
+	less = palloc(state->runs_num * sizeof(uint32));
+	less_equal = palloc(state->runs_num * sizeof(uint32));
+	pivots = palloc(state->runs_num * sizeof(MedianRunPivot));
+
+	*val = runs_select_rank(state, &info, totals, rank, lo, hi, less,
+							less_equal, pivots);
+	if (next != NULL)
+		*next = runs_select_rank(state, &info, totals, rank + 1, lo, hi, less,
+								 less_equal, pivots);
+
+	pfree(lo);
+	pfree(hi);
+	pfree(less);
+	pfree(less_equal);
+	pfree(pivots);
+	if (totals != NULL)
+		pfree(totals);
+}
+
+/*
+ * Moving-aggregate support.
+ *
+ * When median() is used as a window function over a frame whose start moves,
+ * values are added to and removed from the state as the frame slides.  The
+ * state keeps them in an order-statistic tree: a treap whose nodes hold
+ * distinct values with their number of occurrences and the total number of
+ * values in the subtree.  Insertion and removal take O(log w) expected time
+ * and finding the middle elements takes O(log w) time, where w is the frame
+ * size.
+ */
+
+/* Node of the order-statistic tree */
+typedef struct MedianTreeNode
+{
+	Datum		value;
+	/* Number of occurrences of value */
+	uint32		count;
+	/* Total number of occurrences of values in the subtree */
+	uint32		size;
+	/* Heap priority of the treap, randomly chosen */
+	uint32		priority;
+	struct MedianTreeNode *left;
+	struct MedianTreeNode *right;
+}	MedianTreeNode;
+
+/* Internal state used by median moving aggregate */
+typedef struct MedianMovingState
+{
+	MedianTypeInfo type;
+
+	MedianTreeNode *root;
+	/* Removed nodes, kept for reuse */
+	MedianTreeNode *free_nodes;
+	/* State of the pseudo-random generator of priorities */
+	uint32		seed;
+}	MedianMovingState;
+
+#define TREE_SIZE(node) ((node) != NULL ? (node)->size : 0)
+
+static inline MedianTreeNode *
+tree_rotate_right(MedianTreeNode * node)
+{
+	MedianTreeNode *left = node->left;
+
+	node->left = left->right;
+	left->right = node;
+
+	left->size = node->size;
+	node->size = TREE_SIZE(node->left) + TREE_SIZE(node->right) + node->count;
+
+	return left;
+}
+
+static inline MedianTreeNode *
+tree_rotate_left(MedianTreeNode * node)
+{
+	MedianTreeNode *right = node->right;
+
+	node->right = right->left;
+	right->left = node;
+
+	right->size = node->size;
+	node->size = TREE_SIZE(node->left) + TREE_SIZE(node->right) + node->count;
+
+	return right;
+}
+
+/*
+ * Insert an occurrence of value into the subtree, returns the new root of
+ * the subtree.  A new node is created only if the value isn't there yet, the
+ * value is copied into the aggregate context in that case.
+ */
+static MedianTreeNode *
+tree_insert(MedianMovingState * state, MedianTreeNode * node, Datum value,
+			MemoryContext agg_context)
+{
+	int			cmp;
+
+	if (node == NULL)
+	{
+		MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+
+		if (state->free_nodes != NULL)
+		{
+			node = state->free_nodes;
+			state->free_nodes = node->right;
+		}
+		else
+			node = (MedianTreeNode *) palloc(sizeof(MedianTreeNode));
+
+		node->value = typeinfo_copy(&state->type, value);
+
+		MemoryContextSwitchTo(old_context);
+
+		/* xorshift32 */
+		state->seed ^= state->seed << 13;
+		state->seed ^= state->seed >> 17;
+		state->seed ^= state->seed << 5;
+
+		node->count = 1;
+		node->size = 1;
+		node->priority = state->seed;
+		node->left = NULL;
+		node->right = NULL;
+
+		return node;
+	}
+
+	node->size++;
+
+	cmp = typeinfo_compare(&state->type, value, node->value);
+	if (cmp == 0)
+		node->count++;
+	else if (cmp < 0)
+	{
+		node->left = tree_insert(state, node->left, value, agg_context);
+		if (node->left->priority > node->priority)
+			node = tree_rotate_right(node);
+	}
+	else
+	{
+		node->right = tree_insert(state, node->right, value, agg_context);
+		if (node->right->priority > node->priority)
+			node = tree_rotate_left(node);
+	}
+
+	return node;
+}
+
+/*
+ * Remove a node, whose count has dropped to zero, from the treap.  Returns
+ * the new root of the subtree.  The node is rotated down until it has at most
+ * one child and then replaced with that child.
+ */
+static MedianTreeNode *
+tree_remove_node(MedianMovingState * state, MedianTreeNode * node)
+{
+	MedianTreeNode *root;
+
+	if (node->left == NULL || node->right == NULL)
+	{
+		root = node->left != NULL ? node->left : node->right;
+
+		typeinfo_free(&state->type, node->value);
+
+		node->right = state->free_nodes;
+		state->free_nodes = node;
+
+		return root;
+	}
+
+	if (node->left->priority > node->right->priority)
+	{
+		root = tree_rotate_right(node);
+		root->right = tree_remove_node(state, node);
+	}
+	else
+	{
+		root = tree_rotate_left(node);
+		root->left = tree_remove_node(state, node);
+	}
+
+	return root;
+}
+
+/*
+ * Remove an occurrence of value from the subtree, returns the new root of the
+ * subtree.
+ */
+static MedianTreeNode *
+tree_delete(MedianMovingState * state, MedianTreeNode * node, Datum value)
+{
+	int			cmp;
+
+	if (node == NULL)
+		elog(ERROR, "median moving aggregate state doesn't contain the value to remove");
+
+	cmp = typeinfo_compare(&state->type, value, node->value);
+	if (cmp == 0)
+	{
+		if (node->count > 1)
+		{
+			node->count--;
+			node->size--;
+			return node;
+		}
+		node->count = 0;
+		node->size--;
+		return tree_remove_node(state, node);
+	}
+
+	if (cmp < 0)
+		node->left = tree_delete(state, node->left, value);
+	else
+		node->right = tree_delete(state, node->right, value);
+	node->size--;
+
+	return node;
+}
+
+/*
+ * Find the value at the given 0-based position of the sorted values.
+ */
+static Datum
+tree_select(MedianTreeNode * node, uint32 k)
+{
+	for (;;)
+	{
+		uint32		left_size = TREE_SIZE(node->left);
+
+		Assert(node != NULL && k < node->size);
+
+		if (k < left_size)
+			node = node->left;
+		else if (k < left_size + node->count)
+			return node->value;
+		else
+		{
+			k -= left_size + node->count;
+			node = node->right;
+		}
+	}
+}
+
+/*
+ * Median moving-aggregate state transfer function.
+ */
+Datum
+median_moving_transfn(PG_FUNCTION_ARGS)
+{
+	MedianMovingState *state;
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "median_moving_transfn called in non-aggregate context");
+
+	/* If first call, initalize the transition state */
+	if (PG_ARGISNULL(0))
+	{
+		Oid			arg_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+		if (!OidIsValid(arg_type))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("could not determine input data type")));
+
+		state = (MedianMovingState *)
+			MemoryContextAlloc(agg_context, sizeof(MedianMovingState));
+		typeinfo_init(&state->type, arg_type, PG_GET_COLLATION(),
+					  agg_context);
+
+		state->root = NULL;
+		state->free_nodes = NULL;
+		state->seed = 0x9E3779B9;
+	}
+	else
+		state = (MedianMovingState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+		state->root = tree_insert(state, state->root, PG_GETARG_DATUM(1),
+								  agg_context);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Median moving-aggregate inverse transition function.
+ *
+ * Removes a value, which was previously added by median_moving_transfn, from
+ * the state.
+ */
+Datum
+median_moving_invfn(PG_FUNCTION_ARGS)
+{
+	MedianMovingState *state;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "median_moving_invfn called in non-aggregate context");
+
+	/* The state is always initialized by the forward transition function */
+	state = (MedianMovingState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+		state->root = tree_delete(state, state->root, PG_GETARG_DATUM(1));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Median moving-aggregate final function.
+ *
+ * The state isn't modified, since the final function is called for each row
+ * of the window.
+ */
+Datum
+median_moving_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianMovingState *state;
+	uint32		num;
+	Datum		val1;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "median_moving_finalfn called in non-aggregate context");
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianMovingState *) PG_GETARG_POINTER(0);
+
+	/* The frame could contain NULL input values only */
+	num = TREE_SIZE(state->root);
+	if (num == 0)
+		PG_RETURN_NULL();
+
+	val1 = tree_select(state->root, (num - 1) / 2);
+
+	/* For even number of rows get mean of two middle elements */
+	if (num % 2 == 0)
+	{
+		MedianMeanCache *cache;
+		Datum		val2 = tree_select(state->root, num / 2);
+
+		cache = mean_cache_get(fcinfo->flinfo, state->type.arg_type);
+
+		PG_RETURN_DATUM(datum_mean(cache, state->type.arg_typlen,
+								   PG_GET_COLLATION(), val1, val2));
+	}
+	/* For odd number of rows return the middle element */
+	else
+		PG_RETURN_DATUM(val1);
+}
+
+/*
+ * Approximate median.
+ *
+ * approx_median() doesn't keep all the values, but a KLL sketch of them (Z.
+ * Karnin, K. Lang, E. Liberty, "Optimal Quantile Approximation in Streams",
+ * 2016).  The sketch consists of levels of compactors.  A value at level h
+ * stands for 2^h input values.  New values are added to level 0.  Once a
+ * level exceeds its capacity it is sorted, and either the odd or the even
+ * elements, chosen randomly, are promoted to the next level, while the others
+ * are discarded.  The capacity of a level decreases geometrically with its
+ * depth below the top level, so the sketch holds at most about 3k values
+ * regardless of the number of input values.
+ *
+ * The rank of the returned value differs from the rank of the median by at
+ * most about 2.3 / k^0.97 times the number of values with 99% confidence,
+ * see the error analysis of the DataSketches KLL implementation.  The
+ * accuracy argument of approx_median() is this relative rank error, from
+ * which k is derived.  It's 0.01 by default, which gives k = 268.
+ *
+ * Unlike median(), approx_median() always returns one of the input values,
+ * it doesn't average two middle values.
+ */
+
+/* The number of levels is enough for 2^64 values */
+#define SKETCH_MAX_LEVELS 64
+/* Lower levels aren't made smaller than this */
+#define SKETCH_MIN_LEVEL_CAPACITY 8
+#define SKETCH_MIN_K 8
+#define SKETCH_MAX_K 65535
+#define SKETCH_DEFAULT_ACCURACY 0.01
+
+/* A level of the sketch */
+typedef struct MedianSketchLevel
+{
+	Datum	   *items;
+	uint32		num;
+	uint32		alloc;
+	/* The level is compacted once it holds this many items */
+	uint32		capacity;
+}	MedianSketchLevel;
+
+/* Internal state used by approximate median aggregate */
+typedef struct MedianSketchState
+{
+	MedianTypeInfo type;
+
+	/* Capacity of the top level */
+	uint32		k;
+	/* Number of values added to the sketch */
+	uint64		n;
+	/* State of the pseudo-random generator of compaction offsets */
+	uint32		seed;
+
+	int			num_levels;
+	MedianSketchLevel levels[SKETCH_MAX_LEVELS];
+}	MedianSketchState;
+
+/* An item of the sketch together with the number of values it stands for */
+typedef struct MedianSketchItem
+{
+	Datum		value;
+	uint64		weight;
+}	MedianSketchItem;
+
+/*
+ * Convert the requested relative rank error into the sketch parameter k.
+ */
+static uint32
+sketch_accuracy_to_k(float8 accuracy)
+{
+	float8		k;
+
+	if (isnan(accuracy) || accuracy <= 0.0 || accuracy >= 1.0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("accuracy %g is out of range (0, 1)", accuracy)));
+
+	k = ceil(pow(2.296 / accuracy, 1.0 / 0.9723));
+
+	return (uint32) Max(Min(k, SKETCH_MAX_K), SKETCH_MIN_K);
+}
+
+/*
+ * Recompute capacities of the levels after the number of levels changed.
+ */
+static void
+sketch_update_capacities(MedianSketchState * state)
+{
+	float8		capacity = state->k;
+
+	for (int h = state->num_levels - 1; h >= 0; h--)
+	{
+		state->levels[h].capacity = Max((uint32) ceil(capacity),
+										SKETCH_MIN_LEVEL_CAPACITY);
+		capacity *= 2.0 / 3.0;
+	}
+}
+
+/*
+ * Create an empty sketch in the given memory context.
+ */
+static MedianSketchState *
+sketch_create(Oid arg_type, uint32 k, Oid collation, MemoryContext context)
+{
+	MedianSketchState *state;
+
+	state = (MedianSketchState *) MemoryContextAllocZero(context,
+												sizeof(MedianSketchState));
+	typeinfo_init(&state->type, arg_type, collation, context);
+
+	state->k = k;
+	state->n = 0;
+	state->seed = 0x9E3779B9;
+	state->num_levels = 1;
+	sketch_update_capacities(state);
+
+	return state;
+}
+
+/*
+ * Append an item to the level, the item isn't copied.
+ */
+static inline void
+sketch_level_append(MedianSketchLevel * level, Datum value)
+{
+	if (level->num >= level->alloc)
+	{
+		level->alloc = Max(level->alloc * 2, SKETCH_MIN_LEVEL_CAPACITY);
+		if (level->items == NULL)
+			level->items = (Datum *) palloc(level->alloc * sizeof(Datum));
+		else
+			level->items = (Datum *) repalloc(level->items,
+											  level->alloc * sizeof(Datum));
+	}
+	level->items[level->num++] = value;
+}
+
+/*
+ * Comparison function for qsort_arg() over sketch items.
+ */
+static int
+sketch_item_cmp(const void *a, const void *b, void *arg)
+{
+	return typeinfo_compare((MedianTypeInfo *) arg,
+							((const MedianSketchItem *) a)->value,
+							((const MedianSketchItem *) b)->value);
+}
+
+/*
+ * Compact level h: promote every other item to level h + 1.
+ *
+ * If the level has an odd number of items, its smallest item stays in the
+ * level, so that the total weight of the sketch is kept equal to n.
+ */
+static void
+sketch_compact(MedianSketchState * state, int h)
+{
+	MedianSketchLevel *level = &state->levels[h];
+	uint32		start = level->num % 2;
+	uint32		offset;
+
+	if (h + 1 == state->num_levels)
+	{
+		if (state->num_levels >= SKETCH_MAX_LEVELS)
+			elog(ERROR, "too many levels in approximate median sketch");
+		state->num_levels++;
+		sketch_update_capacities(state);
+	}
+
+	qsort_arg(level->items, level->num, sizeof(Datum), typeinfo_datum_cmp,
+			  &state->type);
+
+	/* xorshift32 */
+	state->seed ^= state->seed << 13;
+	state->seed ^= state->seed >> 17;
+	state->seed ^= state->seed << 5;
+	offset = state->seed & 1;
+
+	for (uint32 i = start; i < level->num; i += 2)
+	{
+		sketch_level_append(&state->levels[h + 1], level->items[i + offset]);
+		typeinfo_free(&state->type, level->items[i + 1 - offset]);
+	}
+
+	level->num = start;
+}
+
+/*
+ * Compact all the levels which exceed their capacity.  Returns true if any
+ * level was compacted.
+ */
+static bool
+sketch_compress(MedianSketchState * state)
+{
+	bool		compacted = false;
+
+	for (int h = 0; h < state->num_levels; h++)
+	{
+		if (state->levels[h].num >= state->levels[h].capacity)
+		{
+			sketch_compact(state, h);
+			compacted = true;
+		}
+	}
+
+	return compacted;
+}
+
+/*
+ * Add the items of the source sketch into the destination sketch.  The items
+ * are copied into the current memory context.
+ */
+static void
+sketch_merge(MedianSketchState * source, MedianSketchState * dest)
+{
+	while (dest->num_levels < source->num_levels)
+		dest->num_levels++;
+	dest->k = Min(dest->k, source->k);
+	sketch_update_capacities(dest);
+
+	for (int h = 0; h < source->num_levels; h++)
+	{
+		MedianSketchLevel *level = &source->levels[h];
+
+		for (uint32 i = 0; i < level->num; i++)
+			sketch_level_append(&dest->levels[h],
+								typeinfo_copy(&dest->type, level->items[i]));
+	}
+	dest->n += source->n;
+
+	while (sketch_compress(dest))
+		;
+}
+
+/*
+ * Approximate median state transfer function.
+ *
+ * The optional third argument is the requested accuracy, it's taken from the
+ * first call only.
+ */
+Datum
+approx_median_transfn(PG_FUNCTION_ARGS)
+{
+	MedianSketchState *state;
+	MemoryContext agg_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "approx_median_transfn called in non-aggregate context");
+
+	/* If first call, initalize the transition state */
+	if (PG_ARGISNULL(0))
+	{
+		Oid			arg_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+		float8		accuracy = SKETCH_DEFAULT_ACCURACY;
+
+		if (!OidIsValid(arg_type))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("could not determine input data type")));
+
+		if (PG_NARGS() > 2 && !PG_ARGISNULL(2))
+			accuracy = PG_GETARG_FLOAT8(2);
+
+		state = sketch_create(arg_type, sketch_accuracy_to_k(accuracy),
+							  PG_GET_COLLATION(), agg_context);
+	}
+	else
+		state = (MedianSketchState *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		MemoryContext old_context = MemoryContextSwitchTo(agg_context);
+
+		sketch_level_append(&state->levels[0],
+							typeinfo_copy(&state->type, PG_GETARG_DATUM(1)));
+		state->n++;
+
+		if (state->levels[0].num >= state->levels[0].capacity)
+			sketch_compress(state);
+
+		MemoryContextSwitchTo(old_context);
+	}
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Find the approximate median of the sketch, which has some values.
+ */
+static Datum
+sketch_result(MedianSketchState * state)
+{
+	MedianSketchItem *items;
+	uint32		num = 0;
+	uint64		rank;
+	uint64		weight = 0;
+	Datum		result = (Datum) 0;
+
+	/* Collect all the items with their weights and sort them */
+	for (int h = 0; h < state->num_levels; h++)
+		num += state->levels[h].num;
+
+	items = (MedianSketchItem *) palloc(num * sizeof(MedianSketchItem));
+	num = 0;
+	for (int h = 0; h < state->num_levels; h++)
+	{
+		for (uint32 i = 0; i < state->levels[h].num; i++)
+		{
+			items[num].value = state->levels[h].items[i];
+			items[num].weight = UINT64CONST(1) << h;
+			num++;
+		}
+	}
+
+	qsort_arg(items, num, sizeof(MedianSketchItem), sketch_item_cmp,
+			  &state->type);
+
+	/* Find the item which covers the rank of the (lower) middle element */
+	rank = (state->n - 1) / 2;
+	for (uint32 i = 0; i < num; i++)
+	{
+		weight += items[i].weight;
+		if (weight > rank)
+		{
+			result = items[i].value;
+			break;
+		}
+	}
+
+	pfree(items);
+
+	return result;
+}
+
+/*
+ * Approximate median final function.
+ */
+Datum
+approx_median_finalfn(PG_FUNCTION_ARGS)
+{
+	MedianSketchState *state;
+
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "approx_median_finalfn called in non-aggregate context");
+
+	/* If there were no regular rows, the result is NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (MedianSketchState *) PG_GETARG_POINTER(0);
+
+	/* n could be zero if we only saw NULL input values */
+	if (state->n == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_DATUM(sketch_result(state));
+}
+
+/*
+ * Approximate median combine function.
+ */
+Datum
+approx_median_combinefn(PG_FUNCTION_ARGS)
+{
+	MedianSketchState *state1;
+	MedianSketchState *state2;
+	MemoryContext agg_context;
+	MemoryContext old_context;
+
+	if (!AggCheckCallContext(fcinfo, &agg_context))
+		elog(ERROR, "approx_median_combinefn called in non-aggregate context");
+
+	state1 = PG_ARGISNULL(0) ? NULL : (MedianSketchState *) PG_GETARG_POINTER(0);
+	state2 = PG_ARGISNULL(1) ? NULL : (MedianSketchState *) PG_GETARG_POINTER(1);
+
+	if (state2 == NULL)
+		PG_RETURN_POINTER(state1);
+
+	if (state1 == NULL)
+		state1 = sketch_create(state2->type.arg_type, state2->k,
+							   PG_GET_COLLATION(), agg_context);
+
+	old_context = MemoryContextSwitchTo(agg_context);
+	sketch_merge(state2, state1);
+	MemoryContextSwitchTo(old_context);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * Serialize the sketch.
+ */
+static bytea *
+sketch_serialize(MedianSketchState * state)
+{
+	MedianSerialHeader header;
+	StringInfoData buf;
+	FmgrInfo	send_finfo;
+	Oid			send_proc;
+	bool		typisvarlena;
+
+	pq_begintypsend(&buf);
+
+	header.format = MEDIAN_SERIAL_SKETCH;
+	header.flags = 0;
+	header.arg_type = state->type.arg_type;
+	header.collation = state->type.values_kind == MEDIAN_VALUES_DATUM ?
+		state->type.ctx.collation : InvalidOid;
+	serial_header_send(&buf, &header);
+
+	pq_sendint(&buf, (int) state->k, sizeof(state->k));
+	pq_sendint64(&buf, state->n);
+	pq_sendint(&buf, state->num_levels, sizeof(state->num_levels));
+
+	getTypeBinaryOutputInfo(state->type.arg_type, &send_proc, &typisvarlena);
+	fmgr_info(send_proc, &send_finfo);
+	for (int h = 0; h < state->num_levels; h++)
+	{
+		MedianSketchLevel *level = &state->levels[h];
+
+		pq_sendint(&buf, (int) level->num, sizeof(level->num));
+		for (uint32 i = 0; i < level->num; i++)
+			datum_send(&buf, &send_finfo, level->items[i]);
+	}
+
+	return pq_endtypsend(&buf);
+}
 
 /*
- * Median state transfer function.
- *
- * This function is called for every value in the set that we are calculating
- * the median for. On first call, the aggregate state, if any, needs to be
- * initialized.
+ * Approximate median serialize function.
  */
 Datum
-median_transfn(PG_FUNCTION_ARGS)
+approx_median_serializefn(PG_FUNCTION_ARGS)
 {
-	MedianState *state;
-	MemoryContext agg_context;
-	MemoryContext old_context;
-
-	if (!AggCheckCallContext(fcinfo, &agg_context))
-		elog(ERROR, "median_transfn called in non-aggregate context");
-
-	/* If first call, initalize the transition state */
-	if (PG_ARGISNULL(0))
-	{
-		TypeCacheEntry *typentry;
-		bool		typisvarlena;
-		Oid			arg_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "approx_median_serializefn called in non-aggregate context");
 
-		if (!OidIsValid(arg_type))
-			ereport(ERROR,
-					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-					 errmsg("could not determine input data type")));
+	PG_RETURN_BYTEA_P(sketch_serialize((MedianSketchState *) PG_GETARG_POINTER(0)));
+}
 
-		old_context = MemoryContextSwitchTo(agg_context);
+/*
+ * Deserialize the sketch into the given memory context.
+ */
+static MedianSketchState *
+sketch_deserialize(bytea *sstate, MemoryContext context)
+{
+	MedianSketchState *result;
+	StringInfoData buf;
+	StringInfoData value_buf;
+	FmgrInfo	recv_finfo;
+	Oid			recv_proc;
+	Oid			typioparam;
+	MedianSerialHeader header;
+	MemoryContext old_context;
+	uint32		k;
+	int			num_levels;
+	uint64		weight = 0;
 
-		state = (MedianState *) palloc(sizeof(MedianState));
-		state->arg_type = arg_type;
-		get_typlenbyval(arg_type, &state->arg_typlen, &state->arg_typbyval);
+	serial_buffer_init(&buf, sstate);
+	old_context = MemoryContextSwitchTo(context);
 
-		/* Initialize routines */
-		typentry = lookup_type_cache(arg_type, TYPECACHE_CMP_PROC);
-		if (!OidIsValid(typentry->cmp_proc))
-			ereport(ERROR,
-					(errcode(ERRCODE_UNDEFINED_FUNCTION),
-			   errmsg("could not identify a comparison function for type %s",
-					  format_type_be(arg_type))));
-		state->cmp_proc = typentry->cmp_proc;
+	serial_header_receive(&buf, &header);
+	if (header.format != MEDIAN_SERIAL_SKETCH)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("unexpected approximate median state format %d",
+						(int) header.format)));
 
-		getTypeBinaryOutputInfo(arg_type, &state->send_proc, &typisvarlena);
-		getTypeBinaryInputInfo(arg_type, &state->recv_proc,
-							   &state->arg_typioparam);
+	k = pq_getmsgint(&buf, sizeof(k));
+	if (k < SKETCH_MIN_K || k > SKETCH_MAX_K)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid approximate median state")));
 
-		/* Initialize the values array */
-		state->values_alloc = 8;
-		state->values_num = 0;
-		state->values = (Datum *) palloc(state->values_alloc * sizeof(Datum));
+	result = sketch_create(header.arg_type, k, header.collation, context);
+	result->n = pq_getmsgint64(&buf);
 
-		MemoryContextSwitchTo(old_context);
-	}
-	else
-		state = (MedianState *) PG_GETARG_POINTER(0);
+	num_levels = pq_getmsgint(&buf, sizeof(num_levels));
+	if (num_levels < 1 || num_levels > SKETCH_MAX_LEVELS)
+		elog(ERROR, "invalid number of levels in approximate median sketch");
+	result->num_levels = num_levels;
+	sketch_update_capacities(result);
 
-	/* Copy the datum into the values array, but only if it's not null */
-	if (!PG_ARGISNULL(1))
+	getTypeBinaryInputInfo(header.arg_type, &recv_proc, &typioparam);
+	fmgr_info(recv_proc, &recv_finfo);
+	initStringInfo(&value_buf);
+	for (int h = 0; h < num_levels; h++)
 	{
-		Datum		val;
+		uint32		num = pq_getmsgint(&buf, sizeof(num));
 
-		old_context = MemoryContextSwitchTo(agg_context);
+		serial_check_num(&buf, num, sizeof(int32));
+		if ((uint64) num > (PG_UINT64_MAX - weight) >> h)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+					 errmsg("invalid approximate median state")));
+		weight += (uint64) num << h;
 
-		/* Enlarge values[] if needed */
-		if (state->values_num >= state->values_alloc)
-		{
-			state->values_alloc *= 2;
-			state->values = (Datum *)
-				repalloc(state->values, state->values_alloc * sizeof(Datum));
-		}
+		for (uint32 i = 0; i < num; i++)
+			sketch_level_append(&result->levels[h],
+								datum_receive(&buf, &recv_finfo, typioparam,
+											  &value_buf));
+	}
+	pfree(value_buf.data);
 
-		/* Detoast the argument if it's varlena into the agg_context */
-		if (!state->arg_typbyval && state->arg_type == -1)
-			val = PointerGetDatum(PG_DETOAST_DATUM_COPY(PG_GETARG_DATUM(1)));
-		else
-			val = datumCopy(PG_GETARG_DATUM(1),
-							state->arg_typbyval, state->arg_typlen);
+	pq_getmsgend(&buf);
 
-		state->values[state->values_num] = val;
-		state->values_num++;
+	/*
+	 * The items stand for all the values of the sketch, otherwise the rank
+	 * of the median could be beyond them
+	 */
+	if (weight != result->n)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid approximate median state")));
 
-		MemoryContextSwitchTo(old_context);
-	}
+	MemoryContextSwitchTo(old_context);
 
-	PG_RETURN_POINTER(state);
+	return result;
 }
 
 /*
- * Comparison function for qsort_arg() over values.
+ * Approximate median deserialize function.
  */
-static int
-values_compare(const void *a, const void *b, void *arg)
+Datum
+approx_median_deserializefn(PG_FUNCTION_ARGS)
 {
-	MedianSortContext *state = (MedianSortContext *) arg;
-	Datum		val1 = *((const Datum *) a);
-	Datum		val2 = *((const Datum *) b);
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "approx_median_deserializefn called in non-aggregate context");
 
-	return DatumGetInt32(FunctionCall2Coll(&state->cmp_finfo, state->collation,
-										   val1, val2));
+	PG_RETURN_POINTER(sketch_deserialize(PG_GETARG_BYTEA_PP(0),
+										 CurrentMemoryContext));
 }
 
 /*
- * Get underliyng function's OID of the operator specified by oprname.
+ * Check the header of a median_state value, made by the serialize functions,
+ * and return it in *header.
  */
-static Oid
-operator_funcid(Oid arg_type, char *oprname, char *oprdesc)
+static void
+serial_check_state(bytea *sstate, MedianSerialHeader * header)
 {
-	Oid			oprid;
-	Oid			oprfunc;
+	StringInfoData buf;
 
-	oprid = OpernameGetOprid(list_make1(makeString(oprname)), arg_type, arg_type);
-	if (!OidIsValid(oprid))
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_FUNCTION),
-				 errmsg("could not identify a %s operator for type %s",
-						oprdesc, format_type_be(arg_type))));
+	serial_buffer_init(&buf, sstate);
+	serial_header_receive(&buf, header);
+}
 
-	oprfunc = get_opcode(oprid);
-	if (!OidIsValid(oprfunc))
-		ereport(ERROR,
-				(errcode(ERRCODE_UNDEFINED_FUNCTION),
-				 errmsg("could not identify the procedure for the %s operator for type %s",
-						oprdesc, format_type_be(arg_type))));
+/*
+ * Input function of median_state, the same as of bytea.  Only the header is
+ * checked here, the rest of the state is checked as it's deserialized.  The
+ * header identifies the type of the state by its OID, so only states of
+ * built-in types and collations can be moved between servers.
+ */
+Datum
+median_state_in(PG_FUNCTION_ARGS)
+{
+	Datum		result = DirectFunctionCall1(byteain, PG_GETARG_DATUM(0));
+	MedianSerialHeader header;
 
-	return oprfunc;
+	serial_check_state(DatumGetByteaPP(result), &header);
+
+	PG_RETURN_DATUM(result);
 }
 
 /*
- * Get mean of two datums.
- *
- * We get plus and division operators from the catalog for corresponding
- * arg_type.
+ * Output function of median_state.
  */
-static Datum
-datum_mean(Oid arg_type, Oid collation, Datum arg1, Datum arg2)
+Datum
+median_state_out(PG_FUNCTION_ARGS)
 {
-	Oid			plus_func;
-	Oid			div_func;
-	Oid			typinput;
-	Oid			typioparam;
-	FmgrInfo	flinfo;
-	Datum		sumd;
-	Datum		countd;
-
-	/* First calculate sum of two arguments */
-	plus_func = operator_funcid(arg_type, "+", "plus");
-	fmgr_info(plus_func, &flinfo);
+	PG_RETURN_DATUM(DirectFunctionCall1(byteaout, PG_GETARG_DATUM(0)));
+}
 
-	sumd = FunctionCall2Coll(&flinfo, collation, arg1, arg2);
+/*
+ * Binary input function of median_state.
+ */
+Datum
+median_state_recv(PG_FUNCTION_ARGS)
+{
+	Datum		result = DirectFunctionCall1(bytearecv, PG_GETARG_DATUM(0));
+	MedianSerialHeader header;
 
-	/* Then return mean of two arguments */
-	getTypeInputInfo(arg_type, &typinput, &typioparam);
-	countd = OidInputFunctionCall(typinput, "2", typioparam, -1);
+	serial_check_state(DatumGetByteaPP(result), &header);
 
-	div_func = operator_funcid(arg_type, "/", "division");
-	fmgr_info(div_func, &flinfo);
+	PG_RETURN_DATUM(result);
+}
 
-	return FunctionCall2Coll(&flinfo, collation, sumd, countd);
+/*
+ * Binary output function of median_state.
+ */
+Datum
+median_state_send(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_DATUM(DirectFunctionCall1(byteasend, PG_GETARG_DATUM(0)));
 }
 
 /*
- * Median final function.
+ * Partial states as values.
  *
- * This function is called after all values in the median set has been
- * processed by the state transfer function. It should perform any necessary
- * post processing and clean up any temporary state.
+ * median_partial() and approx_median_partial() aggregate the same way median()
+ * and approx_median() do, but return the serialized state as median_state
+ * instead of the median.  median_merge() combines such states into one, and
+ * median_final() finds the median of a state.  This way partial states can be
+ * stored, for example one per day, and the median over any range of days is
+ * found by merging them.
+ *
+ * The values of an exact state are serialized sorted, so merging exact states
+ * adds a sorted run per state and the final selection works on the runs
+ * rather than on all the values.  A sketch stays bounded in size as sketches
+ * are merged.
+ */
+
+/* Internal state used by median_merge() */
+typedef struct MedianMergeState
+{
+	/* Either of them is set, depending on the format of the merged states */
+	MedianState *exact;
+	MedianSketchState *sketch;
+}	MedianMergeState;
+
+/*
+ * Final function of median_partial().
  */
 Datum
-median_finalfn(PG_FUNCTION_ARGS)
+median_partial_finalfn(PG_FUNCTION_ARGS)
 {
 	MedianState *state;
-	MedianSortContext ctx;
-	MemoryContext agg_context;
-	Datum		val1;
 
-	if (!AggCheckCallContext(fcinfo, &agg_context))
-		elog(ERROR, "median_finalfn called in non-aggregate context");
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "median_partial_finalfn called in non-aggregate context");
 
 	/* If there were no regular rows, the result is NULL */
 	if (PG_ARGISNULL(0))
@@ -238,225 +6388,196 @@ median_finalfn(PG_FUNCTION_ARGS)
 
 	state = (MedianState *) PG_GETARG_POINTER(0);
 
-	/* values_num could be zero if we only saw NULL input values */
-	if (state->values_num == 0)
-		PG_RETURN_NULL();
-
-	/* Sort the values */
-	fmgr_info(state->cmp_proc, &(ctx.cmp_finfo));
-	ctx.collation = PG_GET_COLLATION();
-	qsort_arg(state->values, state->values_num, sizeof(Datum), values_compare,
-			  (void *) &ctx);
-	/* For even number of rows get mean of two middle elements */
-	if (state->values_num % 2 == 0)
-	{
-		Datum		val2;
-
-		/* Get the first middle element */
-		val1 = state->values[state->values_num / 2 - 1];
-		/* Get the second middle element */
-		val2 = state->values[state->values_num / 2];
-
-		PG_RETURN_DATUM(datum_mean(state->arg_type, PG_GET_COLLATION(),
-								   val1, val2));
-	}
-	/* For odd number of rows return the middle element */
-	else
-	{
-		/* Return the middle element */
-		val1 = state->values[state->values_num / 2];
-
-		PG_RETURN_DATUM(val1);
-	}
+	PG_RETURN_BYTEA_P(median_state_serialize(state));
 }
 
 /*
- * Copy median internal state items from source into destination.
+ * Final function of approx_median_partial().
  */
-static void
-medianitems_copy(MedianState * source, MedianState * dest,
-				 MemoryContext agg_context)
+Datum
+approx_median_partial_finalfn(PG_FUNCTION_ARGS)
 {
-	MemoryContext old_context;
-
-	old_context = MemoryContextSwitchTo(agg_context);
+	MedianSketchState *state;
 
-	/* Enlarge values[] if needed */
-	if (dest->values_num + source->values_num > dest->values_alloc)
-	{
-		dest->values_alloc = dest->values_num + source->values_num;
-		dest->values = (Datum *)
-			repalloc(dest->values, dest->values_alloc * sizeof(Datum));
-	}
+	if (!AggCheckCallContext(fcinfo, NULL))
+		elog(ERROR, "approx_median_partial_finalfn called in non-aggregate context");
 
-	for (int i = 0; i < source->values_num; i++)
-	{
-		Datum		val;
+	/* If there were no regular rows, the result is NULL */
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-		/* Detoast the argument if it's varlena into the agg_context */
-		if (!source->arg_typbyval && source->arg_type == -1)
-			val = PointerGetDatum(PG_DETOAST_DATUM_COPY(source->values[i]));
-		else
-			val = datumCopy(source->values[i],
-							source->arg_typbyval, source->arg_typlen);
+	state = (MedianSketchState *) PG_GETARG_POINTER(0);
 
-		dest->values[dest->values_num] = val;
-		dest->values_num++;
-	}
+	PG_RETURN_BYTEA_P(sketch_serialize(state));
+}
 
-	MemoryContextSwitchTo(old_context);
+/*
+ * Check that a state of the given type can be merged into a state of the
+ * merged type.
+ */
+static void
+merge_check_type(Oid merged_type, Oid arg_type)
+{
+	if (merged_type != arg_type)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("cannot merge median states of types %s and %s",
+						format_type_be(merged_type),
+						format_type_be(arg_type))));
 }
 
 /*
- * Median combine function.
+ * median_merge() state transfer function.
+ *
+ * Exact states are deserialized into the aggregate memory context and taken
+ * over by the merged state.  Sketches are deserialized into the per-row
+ * context, as merging copies their items.
  */
 Datum
-median_combinefn(PG_FUNCTION_ARGS)
+median_merge_transfn(PG_FUNCTION_ARGS)
 {
-	MedianState *state1;
-	MedianState *state2;
+	MedianMergeState *state;
 	MemoryContext agg_context;
+	MedianSerialHeader header;
+	bytea	   *sstate;
 
 	if (!AggCheckCallContext(fcinfo, &agg_context))
-		elog(ERROR, "median_combinefn called in non-aggregate context");
+		elog(ERROR, "median_merge_transfn called in non-aggregate context");
 
-	state1 = PG_ARGISNULL(0) ? NULL : (MedianState *) PG_GETARG_POINTER(0);
-	state2 = PG_ARGISNULL(1) ? NULL : (MedianState *) PG_GETARG_POINTER(1);
+	/* If first call, initalize the transition state */
+	if (PG_ARGISNULL(0))
+		state = (MedianMergeState *) MemoryContextAllocZero(agg_context,
+															sizeof(MedianMergeState));
+	else
+		state = (MedianMergeState *) PG_GETARG_POINTER(0);
 
-	if (state2 == NULL)
-		PG_RETURN_POINTER(state1);
+	if (PG_ARGISNULL(1))
+		PG_RETURN_POINTER(state);
 
-	/* Manually copy all fields from state2 to state1 */
-	if (state1 == NULL)
+	sstate = PG_GETARG_BYTEA_PP(1);
+	serial_check_state(sstate, &header);
+
+	if (header.format == MEDIAN_SERIAL_SKETCH)
 	{
+		MedianSketchState *sketch;
 		MemoryContext old_context;
 
-		old_context = MemoryContextSwitchTo(agg_context);
-
-		state1 = (MedianState *) palloc(sizeof(MedianState));
-		state1->arg_type = state2->arg_type;
-		state1->arg_typbyval = state2->arg_typbyval;
-		state1->arg_typlen = state2->arg_typlen;
-		state1->arg_typioparam = state2->arg_typioparam;
+		if (state->exact != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("cannot merge exact and approximate median states")));
 
-		state1->cmp_proc = state2->cmp_proc;
-		state1->send_proc = state2->send_proc;
-		state1->recv_proc = state2->recv_proc;
+		if (state->sketch == NULL)
+		{
+			state->sketch = sketch_deserialize(sstate, agg_context);
+			PG_RETURN_POINTER(state);
+		}
 
-		state1->values_alloc = state2->values_num;
-		state1->values_num = 0;
-		state1->values = (Datum *) palloc(state1->values_alloc * sizeof(Datum));
+		merge_check_type(state->sketch->type.arg_type, header.arg_type);
+		sketch = sketch_deserialize(sstate, CurrentMemoryContext);
 
+		old_context = MemoryContextSwitchTo(agg_context);
+		sketch_merge(sketch, state->sketch);
 		MemoryContextSwitchTo(old_context);
+	}
+	else
+	{
+		MedianState *exact;
 
-		medianitems_copy(state2, state1, agg_context);
+		if (state->sketch != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("cannot merge exact and approximate median states")));
+
+		if (state->exact != NULL)
+			merge_check_type(state->exact->type->arg_type, header.arg_type);
+
+		exact = median_state_deserialize(sstate, fcinfo->flinfo, agg_context);
+		state->exact = median_state_combine(state->exact, exact, agg_context);
 	}
-	else if (state2->values_num > 0)
-		medianitems_copy(state2, state1, agg_context);
 
-	PG_RETURN_POINTER(state1);
+	PG_RETURN_POINTER(state);
 }
 
 /*
- * Median serialize function.
+ * median_merge() final function.
  */
 Datum
-median_serializefn(PG_FUNCTION_ARGS)
+median_merge_finalfn(PG_FUNCTION_ARGS)
 {
-	MedianState *state;
-	StringInfoData buf;
-	FmgrInfo	send_finfo;
+	MedianMergeState *state;
 
 	if (!AggCheckCallContext(fcinfo, NULL))
-		elog(ERROR, "median_serializefn called in non-aggregate context");
-
-	state = (MedianState *) PG_GETARG_POINTER(0);
-	pq_begintypsend(&buf);
-
-	pq_sendint(&buf, (int) state->arg_type, sizeof(state->arg_type));
-	pq_sendbyte(&buf, state->arg_typbyval ? 1 : 0);
-	pq_sendint(&buf, (int) state->arg_typlen, sizeof(state->arg_typlen));
-	pq_sendint(&buf, (int) state->arg_typioparam,
-			   sizeof(state->arg_typioparam));
-
-	pq_sendint(&buf, (int) state->cmp_proc, sizeof(state->cmp_proc));
-	pq_sendint(&buf, (int) state->send_proc, sizeof(state->send_proc));
-	pq_sendint(&buf, (int) state->recv_proc, sizeof(state->recv_proc));
-
-	/* For values_alloc and values_num use same value */
-	pq_sendint(&buf, (int) state->values_num, sizeof(state->values_num));
+		elog(ERROR, "median_merge_finalfn called in non-aggregate context");
 
-	fmgr_info(state->send_proc, &(send_finfo));
-	for (int i = 0; i < state->values_num; i++)
-	{
-		bytea	   *outputbytes;
-
-		outputbytes = SendFunctionCall(&send_finfo, state->values[i]);
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-		pq_sendint(&buf, VARSIZE(outputbytes) - VARHDRSZ, 4);
-		pq_sendbytes(&buf, VARDATA(outputbytes), VARSIZE(outputbytes) - VARHDRSZ);
+	state = (MedianMergeState *) PG_GETARG_POINTER(0);
 
-		pfree(outputbytes);
-	}
+	if (state->exact != NULL)
+		PG_RETURN_BYTEA_P(median_state_serialize(state->exact));
+	if (state->sketch != NULL)
+		PG_RETURN_BYTEA_P(sketch_serialize(state->sketch));
 
-	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+	/* All the merged states were NULL */
+	PG_RETURN_NULL();
 }
 
 /*
- * Median deserialize function.
+ * Find the median of a state made by median_partial() or median_merge().
+ *
+ * The second argument only gives the type of the result, a function
+ * returning anyelement has to take it as an argument.  It has to match the
+ * type of the state.
  */
 Datum
-median_deserializefn(PG_FUNCTION_ARGS)
+median_final(PG_FUNCTION_ARGS)
 {
 	bytea	   *sstate;
-	MedianState *result;
-	StringInfoData buf;
-	FmgrInfo	recv_finfo;
-
-	if (!AggCheckCallContext(fcinfo, NULL))
-		elog(ERROR, "median_deserializefn called in non-aggregate context");
-
-	sstate = PG_GETARG_BYTEA_P(0);
-
-	/*
-	 * Copy the bytea into a StringInfo so that we can "receive" it using the
-	 * standard recv-function infrastructure.
-	 */
-	initStringInfo(&buf);
-	appendBinaryStringInfo(&buf, VARDATA(sstate), VARSIZE(sstate) - VARHDRSZ);
+	MedianSerialHeader header;
+	Oid			arg_type;
 
-	result = (MedianState *) palloc(sizeof(MedianState));
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
 
-	result->arg_type = pq_getmsgint(&buf, sizeof(result->arg_type));
-	result->arg_typbyval = pq_getmsgbyte(&buf) == 1;
-	result->arg_typlen = pq_getmsgint(&buf, sizeof(result->arg_typlen));
-	result->arg_typioparam = pq_getmsgint(&buf, sizeof(result->arg_typioparam));
+	sstate = PG_GETARG_BYTEA_PP(0);
+	serial_check_state(sstate, &header);
 
-	result->cmp_proc = pq_getmsgint(&buf, sizeof(result->cmp_proc));
-	result->send_proc = pq_getmsgint(&buf, sizeof(result->send_proc));
-	result->recv_proc = pq_getmsgint(&buf, sizeof(result->recv_proc));
+	arg_type = get_fn_expr_argtype(fcinfo->flinfo, 1);
+	if (!OidIsValid(arg_type))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("could not determine input data type")));
 
-	result->values_num = result->values_alloc = pq_getmsgint(&buf,
-												 sizeof(result->values_num));
-	result->values = (Datum *) palloc(result->values_alloc * sizeof(Datum));
+	if (header.arg_type != arg_type)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("median state is of type %s, not %s",
+						format_type_be(header.arg_type),
+						format_type_be(arg_type))));
 
-	fmgr_info(result->recv_proc, &(recv_finfo));
-	for (int i = 0; i < result->values_num; i++)
+	if (header.format == MEDIAN_SERIAL_SKETCH)
 	{
-		int			value_len = pq_getmsgint(&buf, 4);
-		const char *value_data = pq_getmsgbytes(&buf, value_len);
-		StringInfoData value_buf;
+		MedianSketchState *sketch = sketch_deserialize(sstate,
+													   CurrentMemoryContext);
 
-		initStringInfo(&value_buf);
-		appendBinaryStringInfo(&value_buf, value_data, value_len);
+		if (sketch->n == 0)
+			PG_RETURN_NULL();
 
-		result->values[i] = ReceiveFunctionCall(&recv_finfo, &value_buf,
-												result->arg_typioparam, -1);
-		pfree(value_buf.data);
+		PG_RETURN_DATUM(sketch_result(sketch));
 	}
+	else
+	{
+		MedianState *state;
 
-	pq_getmsgend(&buf);
-	pfree(buf.data);
+		/* fn_extra of the function holds the mean routines */
+		state = median_state_deserialize(sstate, NULL, CurrentMemoryContext);
 
-	PG_RETURN_POINTER(result);
+		if (values_total(state) == 0)
+			PG_RETURN_NULL();
+
+		PG_RETURN_DATUM(median_state_result(state, fcinfo->flinfo,
+											state->collation));
+	}
 }
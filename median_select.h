@@ -0,0 +1,572 @@
+/*
+ * median_select.h
+ *	  Selection template.
+ *
+ * The file is included several times by median.c, once per representation of
+ * the accumulated values.  Each inclusion generates a selection routine
+ * specialized for one element type and comparison, so that the comparison of
+ * native values can be inlined.
+ *
+ * The following macros have to be defined before the inclusion:
+ *
+ *	  ST_PREFIX - prefix of the generated functions
+ *	  ST_ELEMENT_TYPE - type of the array elements
+ *	  ST_COMPARE(a, b) - compare two elements, returns <0, 0 or >0,
+ *		or ST_COMPARE(a, b, arg) if ST_COMPARE_ARG_TYPE is defined
+ *	  ST_COMPARE_ARG_TYPE - optional type of an extra argument passed down
+ *		to ST_COMPARE
+ *	  ST_ELEMENT_WEIGHT(a) - optional number of values an element stands for,
+ *		to generate the weighted selection instead of the multiple selection
+ *	  ST_PARTITION_LESS(values, n, pivot, or_equal) - optional function
+ *		moving the elements of values[0..n-1] less than the pivot, or less
+ *		than or equal to it, to the front and returning their number, used
+ *		by the selection instead of ST_PARTITION
+ *
+ * The generated functions are:
+ *
+ *	  ST_PREFIX_select(values, lo, hi, k [, arg]) - rearrange values[lo..hi]
+ *		so that values[k] is at its sorted position
+ *	  ST_PREFIX_min(values, lo, hi [, arg]) - index of the smallest element of
+ *		values[lo..hi]
+ *	  ST_PREFIX_sort(values, lo, hi [, arg]) - sort values[lo..hi]
+ *	  ST_PREFIX_multiselect(values, lo, hi, ks, nks [, arg]) - rearrange
+ *		values[lo..hi] so that values[ks[i]] is at its sorted position for
+ *		every i
+ *	  ST_PREFIX_weighted_select(values, lo, hi, rank [, arg]) - rearrange
+ *		values[lo..hi] around the element holding the given rank of the
+ *		values the elements stand for, and return its index
+ *
+ * All the macros are undefined at the end of the file.
+ */
+
+#define ST_MAKE_PREFIX(a) CppConcat(a,_)
+#define ST_MAKE_NAME(a,b) ST_MAKE_NAME_(ST_MAKE_PREFIX(a),b)
+#define ST_MAKE_NAME_(a,b) CppConcat(a,b)
+
+#define ST_SELECT ST_MAKE_NAME(ST_PREFIX, select)
+#define ST_MIN ST_MAKE_NAME(ST_PREFIX, min)
+#define ST_SORT ST_MAKE_NAME(ST_PREFIX, sort)
+#define ST_MULTISELECT ST_MAKE_NAME(ST_PREFIX, multiselect)
+#define ST_WEIGHTED_SELECT ST_MAKE_NAME(ST_PREFIX, weighted_select)
+#define ST_INSERTION_SORT ST_MAKE_NAME(ST_PREFIX, insertion_sort)
+#define ST_MEDIAN3 ST_MAKE_NAME(ST_PREFIX, median3)
+#define ST_MEDIAN_OF_MEDIANS ST_MAKE_NAME(ST_PREFIX, median_of_medians)
+#define ST_PIVOT ST_MAKE_NAME(ST_PREFIX, pivot)
+#define ST_PARTITION ST_MAKE_NAME(ST_PREFIX, partition)
+#define ST_SORTED ST_MAKE_NAME(ST_PREFIX, sorted)
+
+#ifdef ST_COMPARE_ARG_TYPE
+#define ST_COMPARE_ARG_DECL , ST_COMPARE_ARG_TYPE *arg
+#define ST_COMPARE_ARG , arg
+#define DO_COMPARE(a, b) ST_COMPARE(a, b, arg)
+#else
+#define ST_COMPARE_ARG_DECL
+#define ST_COMPARE_ARG
+#define DO_COMPARE(a, b) ST_COMPARE(a, b)
+#endif
+
+#define DO_SWAP(i, j) \
+	do { \
+		ST_ELEMENT_TYPE _tmp = values[i]; \
+		values[i] = values[j]; \
+		values[j] = _tmp; \
+	} while (0)
+
+static uint32 ST_SELECT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi,
+						uint32 k ST_COMPARE_ARG_DECL);
+
+/*
+ * Sort values[lo..hi] using insertion sort.
+ */
+static void
+ST_INSERTION_SORT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi
+				  ST_COMPARE_ARG_DECL)
+{
+	for (uint32 i = lo + 1; i <= hi; i++)
+	{
+		ST_ELEMENT_TYPE val = values[i];
+		uint32		j = i;
+
+		while (j > lo && DO_COMPARE(values[j - 1], val) > 0)
+		{
+			values[j] = values[j - 1];
+			j--;
+		}
+		values[j] = val;
+	}
+}
+
+/*
+ * Check whether values[lo..hi] is already sorted.  The scan stops at the first
+ * element out of order, so that it costs a couple of comparisons on unordered
+ * input and a single pass over presorted input.
+ */
+static inline bool
+ST_SORTED(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi ST_COMPARE_ARG_DECL)
+{
+	for (uint32 i = lo + 1; i <= hi; i++)
+	{
+		if (DO_COMPARE(values[i - 1], values[i]) > 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Return the index of the median of values[a], values[b] and values[c].
+ */
+static inline uint32
+ST_MEDIAN3(ST_ELEMENT_TYPE * values, uint32 a, uint32 b, uint32 c
+		   ST_COMPARE_ARG_DECL)
+{
+	if (DO_COMPARE(values[a], values[b]) < 0)
+	{
+		if (DO_COMPARE(values[b], values[c]) < 0)
+			return b;
+		return DO_COMPARE(values[a], values[c]) < 0 ? c : a;
+	}
+	if (DO_COMPARE(values[b], values[c]) > 0)
+		return b;
+	return DO_COMPARE(values[a], values[c]) > 0 ? c : a;
+}
+
+/*
+ * Pick a pivot for values[lo..hi] using the median-of-medians rule.
+ *
+ * The medians of groups of five elements are moved to the front of the range,
+ * and the median of them is selected recursively.  This guarantees that the
+ * pivot splits the range reasonably, so that the selection stays linear even
+ * on inputs that defeat the median-of-three rule.
+ */
+static uint32
+ST_MEDIAN_OF_MEDIANS(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi
+					 ST_COMPARE_ARG_DECL)
+{
+	uint32		nmedians = 0;
+
+	for (uint32 i = lo; i <= hi; i += 5)
+	{
+		uint32		group_hi = Min(i + 4, hi);
+
+		ST_INSERTION_SORT(values, i, group_hi ST_COMPARE_ARG);
+		DO_SWAP(lo + nmedians, i + (group_hi - i) / 2);
+		nmedians++;
+	}
+
+	return ST_SELECT(values, lo, lo + nmedians - 1,
+					 lo + (nmedians - 1) / 2 ST_COMPARE_ARG);
+}
+
+/*
+ * Pick a pivot for values[lo..hi] by the median-of-three rule, or for larger
+ * ranges by Tukey's ninther, the median of the medians of three triples spread
+ * over the range, which is much less likely to be near either end on sorted,
+ * reverse-sorted or organ-pipe input.
+ */
+static inline uint32
+ST_PIVOT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi ST_COMPARE_ARG_DECL)
+{
+	uint32		mid = lo + (hi - lo) / 2;
+	uint32		step;
+
+	if (hi - lo + 1 <= SELECT_NINTHER_THRESHOLD)
+		return ST_MEDIAN3(values, lo, mid, hi ST_COMPARE_ARG);
+
+	step = (hi - lo + 1) / 8;
+	return ST_MEDIAN3(values,
+					  ST_MEDIAN3(values, lo, lo + step, lo + 2 * step
+								 ST_COMPARE_ARG),
+					  ST_MEDIAN3(values, mid - step, mid, mid + step
+								 ST_COMPARE_ARG),
+					  ST_MEDIAN3(values, hi - 2 * step, hi - step, hi
+								 ST_COMPARE_ARG)
+					  ST_COMPARE_ARG);
+}
+
+/*
+ * Partition values[lo..hi] around values[pivot] into three parts: elements
+ * less than the pivot, elements equal to it and elements greater than it.
+ * The bounds of the equal part, which holds the pivot, are returned in
+ * *eq_lo and *eq_hi.
+ *
+ * This is the Bentley-McIlroy partitioning: the range is scanned from both
+ * ends as usual, except that elements equal to the pivot are swapped out to
+ * the ends of the range, and moved to the middle at the end.  It costs no more
+ * comparisons than a two-way partitioning, and the equal elements, however
+ * many there are, are done with at once.
+ */
+static void
+ST_PARTITION(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi, uint32 pivot,
+			 uint32 *eq_lo, uint32 *eq_hi ST_COMPARE_ARG_DECL)
+{
+	uint32		a = lo + 1;
+	uint32		b = lo + 1;
+	uint32		c = hi;
+	uint32		d = hi;
+	uint32		n;
+	ST_ELEMENT_TYPE pivot_val;
+
+	DO_SWAP(lo, pivot);
+	pivot_val = values[lo];
+
+	/*
+	 * values[lo..a-1] and values[d+1..hi] are equal to the pivot,
+	 * values[a..b-1] are less than it and values[c+1..d] are greater than it
+	 */
+	for (;;)
+	{
+		int			cmp;
+
+		while (b <= c && (cmp = DO_COMPARE(values[b], pivot_val)) <= 0)
+		{
+			if (cmp == 0)
+			{
+				DO_SWAP(a, b);
+				a++;
+			}
+			b++;
+		}
+		while (b <= c && (cmp = DO_COMPARE(values[c], pivot_val)) >= 0)
+		{
+			if (cmp == 0)
+			{
+				DO_SWAP(c, d);
+				d--;
+			}
+			c--;
+		}
+		if (b > c)
+			break;
+		DO_SWAP(b, c);
+		b++;
+		c--;
+	}
+
+	/* Move the equal elements from both ends to the middle */
+	n = Min(a - lo, b - a);
+	for (uint32 i = 0; i < n; i++)
+		DO_SWAP(lo + i, b - n + i);
+	n = Min(d - c, hi - d);
+	for (uint32 i = 0; i < n; i++)
+		DO_SWAP(b + i, hi - n + 1 + i);
+
+	*eq_lo = lo + (b - a);
+	*eq_hi = hi - (d - c);
+}
+
+/*
+ * Rearrange values[lo..hi] so that values[k] is the element which would be
+ * there if the range was sorted, every element before it is less than or
+ * equal to it and every element after it is greater than or equal to it.
+ *
+ * This is introselect: quickselect with ninther pivots and three-way
+ * partitioning, which falls back to median-of-medians pivots once the
+ * partitioning makes too little progress.  Presorted input is checked for
+ * first, it needs no partitioning at all, and the elements equal to the pivot
+ * are done with in a single step, however many duplicates there are.
+ *
+ * Large ranges are split Floyd-Rivest style instead: the element of rank k is
+ * selected recursively within a window of about n^(2/3) elements around
+ * position k, which makes it a pivot close to the k-th element.  The window
+ * is placed so that the pivot most likely lies a bit beyond the k-th element,
+ * on the side of the smaller part, so that the part left after partitioning
+ * around it is that smaller part or a small fraction of the range.  Returns k.
+ */
+static uint32
+ST_SELECT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi, uint32 k
+		  ST_COMPARE_ARG_DECL)
+{
+	int			depth_limit = 0;
+
+	Assert(lo <= k && k <= hi);
+
+	check_stack_depth();
+
+	if (ST_SORTED(values, lo, hi ST_COMPARE_ARG))
+		return k;
+
+	/* Allow 2 * log2(n) partitioning steps before falling back */
+	for (uint32 n = hi - lo + 1; n > 1; n >>= 1)
+		depth_limit += 2;
+
+	while (hi - lo + 1 > SELECT_SMALL_THRESHOLD)
+	{
+		uint32		pivot;
+#ifndef ST_PARTITION_LESS
+		uint32		eq_lo;
+		uint32		eq_hi;
+#endif
+
+		if (depth_limit-- <= 0)
+			pivot = ST_MEDIAN_OF_MEDIANS(values, lo, hi ST_COMPARE_ARG);
+		else if (hi - lo + 1 > SELECT_SAMPLE_THRESHOLD)
+		{
+			double		n = hi - lo + 1;
+			double		i = k - lo + 1;
+			double		z = log(n);
+			double		s = 0.5 * exp(2 * z / 3);
+			double		sd = 0.5 * sqrt(z * s * (n - s) / n) *
+				(i < n / 2 ? -1 : 1);
+			double		window_lo = k - i * s / n + sd;
+			double		window_hi = k + (n - i) * s / n + sd;
+
+			pivot = ST_SELECT(values,
+							  (uint32) Max(window_lo, (double) lo),
+							  (uint32) Min(window_hi, (double) hi),
+							  k ST_COMPARE_ARG);
+		}
+		else
+			pivot = ST_PIVOT(values, lo, hi ST_COMPARE_ARG);
+
+#ifdef ST_PARTITION_LESS
+		{
+			ST_ELEMENT_TYPE pivot_val = values[pivot];
+			uint32		mid;
+
+			mid = lo + ST_PARTITION_LESS(values + lo, hi - lo + 1, pivot_val,
+										 false);
+			if (k < mid)
+			{
+				hi = mid - 1;
+				continue;
+			}
+			if (mid > lo)
+			{
+				lo = mid;
+				continue;
+			}
+
+			/*
+			 * The pivot is the smallest element of the range, so the elements
+			 * equal to it are moved to the front to make progress.  This
+			 * makes the partitioning three-way without a second pass over
+			 * every range: once the upper part starts with many duplicates
+			 * of a pivot, the next pivot is most likely one of them, and all
+			 * of them are done with here.
+			 */
+			mid = lo + ST_PARTITION_LESS(values + lo, hi - lo + 1, pivot_val,
+										 true);
+			if (k < mid)
+				return k;
+			lo = mid;
+		}
+#else
+		ST_PARTITION(values, lo, hi, pivot, &eq_lo, &eq_hi ST_COMPARE_ARG);
+
+		if (k < eq_lo)
+			hi = eq_lo - 1;
+		else if (k > eq_hi)
+			lo = eq_hi + 1;
+		else
+			return k;
+#endif
+	}
+
+	ST_INSERTION_SORT(values, lo, hi ST_COMPARE_ARG);
+	return k;
+}
+
+/*
+ * Return the index of the smallest element of values[lo..hi].
+ */
+static uint32
+ST_MIN(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi ST_COMPARE_ARG_DECL)
+{
+	uint32		min = lo;
+
+	for (uint32 i = lo + 1; i <= hi; i++)
+	{
+		if (DO_COMPARE(values[i], values[min]) < 0)
+			min = i;
+	}
+
+	return min;
+}
+
+/*
+ * Sort values[lo..hi].
+ *
+ * This is quicksort with the same pivot rules and partitioning as the
+ * selection, so that it can't go quadratic either.  It recurses into the
+ * smaller part and loops over the larger one, which bounds the recursion
+ * depth by log2(n).
+ */
+static void
+ST_SORT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi ST_COMPARE_ARG_DECL)
+{
+	int			depth_limit = 0;
+
+	check_stack_depth();
+
+	if (ST_SORTED(values, lo, hi ST_COMPARE_ARG))
+		return;
+
+	/* Allow 2 * log2(n) partitioning steps before falling back */
+	for (uint32 n = hi - lo + 1; n > 1; n >>= 1)
+		depth_limit += 2;
+
+	while (hi - lo + 1 > SELECT_SMALL_THRESHOLD)
+	{
+		uint32		pivot;
+		uint32		eq_lo;
+		uint32		eq_hi;
+
+		if (depth_limit-- > 0)
+			pivot = ST_PIVOT(values, lo, hi ST_COMPARE_ARG);
+		else
+			pivot = ST_MEDIAN_OF_MEDIANS(values, lo, hi ST_COMPARE_ARG);
+
+		ST_PARTITION(values, lo, hi, pivot, &eq_lo, &eq_hi ST_COMPARE_ARG);
+
+		if (eq_lo - lo < hi - eq_hi)
+		{
+			if (eq_lo > lo)
+				ST_SORT(values, lo, eq_lo - 1 ST_COMPARE_ARG);
+			if (eq_hi == hi)
+				return;
+			lo = eq_hi + 1;
+		}
+		else
+		{
+			if (eq_hi < hi)
+				ST_SORT(values, eq_hi + 1, hi ST_COMPARE_ARG);
+			if (eq_lo == lo)
+				return;
+			hi = eq_lo - 1;
+		}
+	}
+
+	ST_INSERTION_SORT(values, lo, hi ST_COMPARE_ARG);
+}
+
+#ifndef ST_ELEMENT_WEIGHT
+
+/*
+ * Rearrange values[lo..hi] so that values[ks[i]] is the element which would be
+ * there if the range was sorted, for every i.  ks has to be sorted in
+ * ascending order and hold no duplicates.
+ *
+ * The range is partitioned around the middle requested position first, and
+ * the parts on both sides of it are rearranged for the positions falling into
+ * them, so that the values are passed over about log2(nks) times rather than
+ * nks times.  It recurses into the lower part and loops over the upper one.
+ */
+static void
+ST_MULTISELECT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi, uint32 *ks,
+			   int nks ST_COMPARE_ARG_DECL)
+{
+	check_stack_depth();
+
+	while (nks > 0)
+	{
+		int			mid = nks / 2;
+		uint32		k = ks[mid];
+
+		ST_SELECT(values, lo, hi, k ST_COMPARE_ARG);
+
+		if (mid > 0)
+			ST_MULTISELECT(values, lo, k - 1, ks, mid ST_COMPARE_ARG);
+
+		lo = k + 1;
+		ks += mid + 1;
+		nks -= mid + 1;
+	}
+}
+
+#else							/* ST_ELEMENT_WEIGHT */
+
+/*
+ * Find the element of values[lo..hi] holding the given rank, counting each
+ * element ST_ELEMENT_WEIGHT() times, and return its index.  The range is
+ * rearranged so that every element before it is less than or equal to it and
+ * every element after it is greater than or equal to it.  The rank is set to
+ * the rank within the returned element.
+ *
+ * This is the selection above, except that the side to continue with is
+ * chosen by the total weight of the elements before the equal part.
+ */
+static uint32
+ST_WEIGHTED_SELECT(ST_ELEMENT_TYPE * values, uint32 lo, uint32 hi,
+				   uint64 *rank ST_COMPARE_ARG_DECL)
+{
+	int			depth_limit = 0;
+	bool		sorted;
+
+	check_stack_depth();
+
+	sorted = ST_SORTED(values, lo, hi ST_COMPARE_ARG);
+
+	/* Allow 2 * log2(n) partitioning steps before falling back */
+	for (uint32 n = hi - lo + 1; n > 1; n >>= 1)
+		depth_limit += 2;
+
+	while (!sorted && hi - lo + 1 > SELECT_SMALL_THRESHOLD)
+	{
+		uint32		pivot;
+		uint32		eq_lo;
+		uint32		eq_hi;
+		uint64		before = 0;
+		uint64		equal = 0;
+
+		if (depth_limit-- > 0)
+			pivot = ST_PIVOT(values, lo, hi ST_COMPARE_ARG);
+		else
+			pivot = ST_MEDIAN_OF_MEDIANS(values, lo, hi ST_COMPARE_ARG);
+
+		ST_PARTITION(values, lo, hi, pivot, &eq_lo, &eq_hi ST_COMPARE_ARG);
+
+		for (uint32 i = lo; i < eq_lo; i++)
+			before += ST_ELEMENT_WEIGHT(values[i]);
+		for (uint32 i = eq_lo; i <= eq_hi; i++)
+			equal += ST_ELEMENT_WEIGHT(values[i]);
+
+		if (*rank < before)
+			hi = eq_lo - 1;
+		else if (*rank - before < equal)
+		{
+			*rank -= before;
+			lo = eq_lo;
+			hi = eq_hi;
+			sorted = true;	/* equal elements are in order */
+		}
+		else
+		{
+			*rank -= before + equal;
+			lo = eq_hi + 1;
+		}
+	}
+
+	if (!sorted)
+		ST_INSERTION_SORT(values, lo, hi ST_COMPARE_ARG);
+	while (*rank >= ST_ELEMENT_WEIGHT(values[lo]))
+		*rank -= ST_ELEMENT_WEIGHT(values[lo++]);
+	return lo;
+}
+
+#endif							/* ST_ELEMENT_WEIGHT */
+
+#undef ST_MAKE_PREFIX
+#undef ST_MAKE_NAME
+#undef ST_MAKE_NAME_
+#undef ST_SELECT
+#undef ST_MIN
+#undef ST_SORT
+#undef ST_MULTISELECT
+#undef ST_WEIGHTED_SELECT
+#undef ST_INSERTION_SORT
+#undef ST_MEDIAN3
+#undef ST_MEDIAN_OF_MEDIANS
+#undef ST_PIVOT
+#undef ST_PARTITION
+#undef ST_SORTED
+#undef ST_COMPARE_ARG_DECL
+#undef ST_COMPARE_ARG
+#undef DO_COMPARE
+#undef DO_SWAP
+#undef ST_PREFIX
+#undef ST_ELEMENT_TYPE
+#undef ST_COMPARE
+#undef ST_COMPARE_ARG_TYPE
+#undef ST_ELEMENT_WEIGHT
+#undef ST_PARTITION_LESS
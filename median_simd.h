@@ -0,0 +1,348 @@
+/*
+ * median_simd.h
+ *	  Vectorized partitioning of native values.
+ *
+ * The file is included once by median.c, before the selection template.  It
+ * provides the partitioning step of the selection over int64 and float8
+ * arrays, which moves the elements less than the pivot, or less than or equal
+ * to it, to the front of the array:
+ *
+ *	  int64_partition_less(values, n, pivot, or_equal)
+ *	  float8_partition_less(values, n, pivot, or_equal)
+ *
+ * Both return the number of elements moved to the front.  Floats are ordered
+ * the same way btree comparison of float types orders them: NaNs are equal to
+ * each other and greater than any other value.
+ *
+ * On x86-64 the elements are partitioned four at a time with AVX2, if the CPU
+ * supports it, which is checked on the first call.  Otherwise, and for short
+ * arrays, a scalar branchless partitioning is used.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define MEDIAN_USE_AVX2
+#include <immintrin.h>
+#endif
+
+/*
+ * Scalar partitioning step for values[i]: the element is swapped with the
+ * first element of the back part and the front part grows if it belongs
+ * there, so that there are no branches depending on the data.
+ */
+#define PARTITION_STEP(type, left_cond) \
+	do { \
+		type		_v = values[i]; \
+		bool		_left = (left_cond); \
+		values[i] = values[m]; \
+		values[m] = _v; \
+		m += _left; \
+	} while (0)
+
+static uint32
+int64_partition_less_scalar(int64 *values, uint32 n, int64 pivot,
+							bool or_equal)
+{
+	uint32		m = 0;
+
+	if (or_equal)
+	{
+		for (uint32 i = 0; i < n; i++)
+			PARTITION_STEP(int64, _v <= pivot);
+	}
+	else
+	{
+		for (uint32 i = 0; i < n; i++)
+			PARTITION_STEP(int64, _v < pivot);
+	}
+
+	return m;
+}
+
+static uint32
+float8_partition_less_scalar(float8 *values, uint32 n, float8 pivot,
+							 bool or_equal)
+{
+	uint32		m = 0;
+
+	/* Every value is less than or equal to NaN */
+	if (isnan(pivot) && or_equal)
+		return n;
+
+	if (isnan(pivot))
+	{
+		for (uint32 i = 0; i < n; i++)
+			PARTITION_STEP(float8, !isnan(_v));
+	}
+	else if (or_equal)
+	{
+		for (uint32 i = 0; i < n; i++)
+			PARTITION_STEP(float8, _v <= pivot);
+	}
+	else
+	{
+		for (uint32 i = 0; i < n; i++)
+			PARTITION_STEP(float8, _v < pivot);
+	}
+
+	return m;
+}
+
+#ifdef MEDIAN_USE_AVX2
+
+/* Comparison an AVX2 partitioning is done with */
+typedef enum MedianPartitionMode
+{
+	PARTITION_INT64_LESS,
+	PARTITION_INT64_LESS_EQUAL,
+	PARTITION_FLOAT8_LESS,
+	PARTITION_FLOAT8_LESS_EQUAL,
+	PARTITION_FLOAT8_NOT_NAN	/* less than a NaN pivot */
+}	MedianPartitionMode;
+
+/*
+ * Permutations of four 64-bit lanes, as pairs of 32-bit lanes, which move the
+ * lanes set in the index to the front, keeping their order.
+ */
+static const int32 partition_perms[16][8] = {
+	{0, 1, 2, 3, 4, 5, 6, 7},
+	{0, 1, 2, 3, 4, 5, 6, 7},
+	{2, 3, 0, 1, 4, 5, 6, 7},
+	{0, 1, 2, 3, 4, 5, 6, 7},
+	{4, 5, 0, 1, 2, 3, 6, 7},
+	{0, 1, 4, 5, 2, 3, 6, 7},
+	{2, 3, 4, 5, 0, 1, 6, 7},
+	{0, 1, 2, 3, 4, 5, 6, 7},
+	{6, 7, 0, 1, 2, 3, 4, 5},
+	{0, 1, 6, 7, 2, 3, 4, 5},
+	{2, 3, 6, 7, 0, 1, 4, 5},
+	{0, 1, 2, 3, 6, 7, 4, 5},
+	{4, 5, 6, 7, 0, 1, 2, 3},
+	{0, 1, 4, 5, 6, 7, 2, 3},
+	{2, 3, 4, 5, 6, 7, 0, 1},
+	{0, 1, 2, 3, 4, 5, 6, 7}
+};
+
+/*
+ * Check whether a single value goes to the front part, for the values which
+ * don't make up a whole vector.
+ */
+static inline bool
+partition_goes_left(int64 val, int64 pivot, MedianPartitionMode mode)
+{
+	float8		fval;
+	float8		fpivot;
+
+	memcpy(&fval, &val, sizeof(fval));
+	memcpy(&fpivot, &pivot, sizeof(fpivot));
+
+	switch (mode)
+	{
+		case PARTITION_INT64_LESS:
+			return val < pivot;
+		case PARTITION_INT64_LESS_EQUAL:
+			return val <= pivot;
+		case PARTITION_FLOAT8_LESS:
+			return fval < fpivot;
+		case PARTITION_FLOAT8_LESS_EQUAL:
+			return fval <= fpivot;
+		default:
+			return !isnan(fval);
+	}
+}
+
+/*
+ * Mask of the lanes of the vector which go to the front part.  Ordered float
+ * comparisons are false for NaNs, which puts them behind any other pivot.
+ */
+static inline __attribute__((always_inline, target("avx2"))) int
+avx2_left_mask(__m256i v, __m256i pivot, MedianPartitionMode mode)
+{
+	__m256d		fv = _mm256_castsi256_pd(v);
+	__m256d		fpivot = _mm256_castsi256_pd(pivot);
+
+	switch (mode)
+	{
+		case PARTITION_INT64_LESS:
+			return _mm256_movemask_pd(_mm256_castsi256_pd(
+										  _mm256_cmpgt_epi64(pivot, v)));
+		case PARTITION_INT64_LESS_EQUAL:
+			return ~_mm256_movemask_pd(_mm256_castsi256_pd(
+										   _mm256_cmpgt_epi64(v, pivot))) & 0xF;
+		case PARTITION_FLOAT8_LESS:
+			return _mm256_movemask_pd(_mm256_cmp_pd(fv, fpivot, _CMP_LT_OQ));
+		case PARTITION_FLOAT8_LESS_EQUAL:
+			return _mm256_movemask_pd(_mm256_cmp_pd(fv, fpivot, _CMP_LE_OQ));
+		default:
+			return _mm256_movemask_pd(_mm256_cmp_pd(fv, fv, _CMP_ORD_Q));
+	}
+}
+
+/*
+ * Partition the vector and store it at both the front and the back write
+ * positions.  The lanes going to the front are permuted to the beginning of
+ * the vector and the others follow them, so that each store puts its lanes in
+ * place, while the rest of the store lands in free space.
+ */
+static inline __attribute__((always_inline, target("avx2,popcnt"))) void
+avx2_partition_store(int64 *values, uint32 *write_left, uint32 *write_right,
+					 __m256i v, __m256i pivot, MedianPartitionMode mode)
+{
+	int			mask = avx2_left_mask(v, pivot, mode);
+	int			nleft = _mm_popcnt_u32(mask);
+	__m256i		perm = _mm256_loadu_si256((const __m256i *) partition_perms[mask]);
+	__m256i		p = _mm256_permutevar8x32_epi32(v, perm);
+
+	_mm256_storeu_si256((__m256i *) (values + *write_left), p);
+	_mm256_storeu_si256((__m256i *) (values + *write_right - 4), p);
+	*write_left += nleft;
+	*write_right -= 4 - nleft;
+}
+
+/*
+ * Partition values[0..n-1] in place, n has to be at least 8.
+ *
+ * The first and the last vectors are kept in registers, which leaves space
+ * for four values both in front of and behind the unread values.  Each step
+ * reads a vector from the side with less free space, so that both sides have
+ * space for a whole vector store.  The values which don't make up a vector,
+ * and then the two vectors kept aside, are stored in the end.
+ */
+static inline __attribute__((always_inline, target("avx2,popcnt"))) uint32
+avx2_partition(int64 *values, uint32 n, int64 pivot_val,
+			   MedianPartitionMode mode)
+{
+	__m256i		pivot = _mm256_set1_epi64x(pivot_val);
+	__m256i		first = _mm256_loadu_si256((const __m256i *) values);
+	__m256i		last = _mm256_loadu_si256((const __m256i *) (values + n - 4));
+	uint32		read_left = 4;
+	uint32		read_right = n - 4;
+	uint32		write_left = 0;
+	uint32		write_right = n;
+	int64		rest[3];
+	int			nrest = 0;
+
+	Assert(n >= 8);
+
+	while (read_right - read_left >= 4)
+	{
+		__m256i		v;
+
+		if (read_left - write_left <= write_right - read_right)
+		{
+			v = _mm256_loadu_si256((const __m256i *) (values + read_left));
+			read_left += 4;
+		}
+		else
+		{
+			read_right -= 4;
+			v = _mm256_loadu_si256((const __m256i *) (values + read_right));
+		}
+
+		avx2_partition_store(values, &write_left, &write_right, v, pivot,
+							 mode);
+	}
+
+	/* Now all the values between the write positions are free */
+	while (read_left < read_right)
+		rest[nrest++] = values[read_left++];
+	for (int i = 0; i < nrest; i++)
+	{
+		if (partition_goes_left(rest[i], pivot_val, mode))
+			values[write_left++] = rest[i];
+		else
+			values[--write_right] = rest[i];
+	}
+
+	avx2_partition_store(values, &write_left, &write_right, first, pivot,
+						 mode);
+	avx2_partition_store(values, &write_left, &write_right, last, pivot,
+						 mode);
+
+	Assert(write_left == write_right);
+	return write_left;
+}
+
+static __attribute__((target("avx2,popcnt"))) uint32
+int64_partition_less_avx2(int64 *values, uint32 n, int64 pivot,
+						  bool or_equal)
+{
+	if (n < 8)
+		return int64_partition_less_scalar(values, n, pivot, or_equal);
+
+	if (or_equal)
+		return avx2_partition(values, n, pivot, PARTITION_INT64_LESS_EQUAL);
+	return avx2_partition(values, n, pivot, PARTITION_INT64_LESS);
+}
+
+static __attribute__((target("avx2,popcnt"))) uint32
+float8_partition_less_avx2(float8 *values, uint32 n, float8 pivot,
+						   bool or_equal)
+{
+	int64		pivot_bits;
+
+	if (n < 8 || (isnan(pivot) && or_equal))
+		return float8_partition_less_scalar(values, n, pivot, or_equal);
+
+	/* The values are moved as 64-bit integers, and compared as floats */
+	memcpy(&pivot_bits, &pivot, sizeof(pivot_bits));
+
+	if (isnan(pivot))
+		return avx2_partition((int64 *) values, n, pivot_bits,
+							  PARTITION_FLOAT8_NOT_NAN);
+	if (or_equal)
+		return avx2_partition((int64 *) values, n, pivot_bits,
+							  PARTITION_FLOAT8_LESS_EQUAL);
+	return avx2_partition((int64 *) values, n, pivot_bits,
+						  PARTITION_FLOAT8_LESS);
+}
+
+#endif							/* MEDIAN_USE_AVX2 */
+
+/*
+ * The partitioning functions are chosen on the first call, the same way
+ * pg_popcount() chooses its implementation.
+ */
+static uint32 int64_partition_less_choose(int64 *values, uint32 n,
+										  int64 pivot, bool or_equal);
+static uint32 float8_partition_less_choose(float8 *values, uint32 n,
+										   float8 pivot, bool or_equal);
+
+static uint32 (*int64_partition_less) (int64 *values, uint32 n, int64 pivot,
+									   bool or_equal) =
+int64_partition_less_choose;
+static uint32 (*float8_partition_less) (float8 *values, uint32 n,
+										float8 pivot, bool or_equal) =
+float8_partition_less_choose;
+
+static void
+partition_choose(void)
+{
+#ifdef MEDIAN_USE_AVX2
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+	{
+		int64_partition_less = int64_partition_less_avx2;
+		float8_partition_less = float8_partition_less_avx2;
+		return;
+	}
+#endif
+	int64_partition_less = int64_partition_less_scalar;
+	float8_partition_less = float8_partition_less_scalar;
+}
+
+static uint32
+int64_partition_less_choose(int64 *values, uint32 n, int64 pivot,
+							bool or_equal)
+{
+	partition_choose();
+	return int64_partition_less(values, n, pivot, or_equal);
+}
+
+static uint32
+float8_partition_less_choose(float8 *values, uint32 n, float8 pivot,
+							 bool or_equal)
+{
+	partition_choose();
+	return float8_partition_less(values, n, pivot, or_equal);
+}
+
+#undef PARTITION_STEP
@@ -31,9 +31,49 @@ SELECT median(val) FROM intvals;
 -- Integers GROUP BY color
 SELECT color, median(val) FROM intvals GROUP BY color ORDER BY color;
 
+-- Groups of a few values and groups outgrowing the values kept in the state
+SELECT g, median(i) FROM generate_series(1, 20) AS t(i), generate_series(1, 4) AS s(g)
+WHERE i <= g * 5 GROUP BY g ORDER BY g;
+
 -- Window function with integers
 SELECT color, val, median(val) OVER (PARTITION BY color) FROM intvals ORDER BY color, val;
 
+-- Sliding window function with integers
+SELECT i, median(v) OVER (ORDER BY i ROWS BETWEEN 2 PRECEDING AND CURRENT ROW)
+FROM (VALUES (1, 5), (2, 1), (3, NULL), (4, 9), (5, 3), (6, 3), (7, 8),
+             (8, NULL), (9, NULL), (10, NULL)) AS t(i, v);
+
+-- Mean of two middle integers doesn't overflow
+SELECT median(val) FROM (VALUES (2147483647), (2147483645)) AS t(val);
+
+-- Exact mean of two middle values
+SELECT median(i), median_cont(i) FROM generate_series(1, 4) AS t(i);
+SELECT median_cont(val) FROM (VALUES (9223372036854775807), (-9223372036854775807 - 1)) AS t(val);
+SELECT median_cont(val) FROM (VALUES (1.25), (1.5), (NULL)) AS t(val);
+
+-- Median of the elements of an array
+SELECT array_median(ARRAY[5, NULL, 1, 9, 3]), array_median(ARRAY[4.5, 1, 2, 3]::float8[]),
+       array_median(ARRAY['b', 'a', 'c']);
+CREATE DOMAIN intarr AS int4[];
+SELECT array_median(ARRAY[5, 1, 9]::intarr);
+
+-- Element-wise median of float8 arrays
+SELECT median_elementwise(v) FROM (VALUES (ARRAY[1, 10, NULL]::float8[]), (ARRAY[2, 30, NULL]), (NULL),
+                                          (ARRAY[4, 20, NULL])) AS t(v);
+SELECT median_elementwise(v) FROM (VALUES (ARRAY[1, 2]::float8[]), (ARRAY[1])) AS t(v); -- fails
+SELECT median(v) FROM (VALUES (ARRAY[1, 2]::float8[]), (ARRAY[1]), (ARRAY[3])) AS t(v);
+
+-- Floats, NaN is greater than any other value
+CREATE TABLE floatvals(val float8);
+
+INSERT INTO floatvals VALUES (1.5), ('NaN'), (-2), (10), (3.25);
+
+SELECT median(val) FROM floatvals;
+
+INSERT INTO floatvals VALUES (4);
+
+SELECT median(val) FROM floatvals;
+
 -- Text values
 CREATE TABLE textvals(val text, color int);
 
@@ -47,12 +87,44 @@ INSERT INTO textvals VALUES
 SELECT * FROM textvals ORDER BY val;
 SELECT median(val) FROM textvals;
 
+-- Compressed text values are detoasted once
+CREATE TABLE toastvals AS SELECT repeat(chr(65 + i % 26), 5000) || i AS val FROM generate_series(1, 101) AS t(i);
+SELECT left(m, 1), right(m, 2), length(m) FROM (SELECT median(val) AS m FROM toastvals) AS s;
+
 -- Text with even number of values
 INSERT INTO textvals VALUES
        ('extra', 5);
 
 SELECT median(val) FROM textvals; -- fails
 
+-- Percentiles
+SELECT percentiles(val, ARRAY[0, 0.25, 0.5, 0.9, 1]) FROM intvals;
+SELECT percentiles(val, ARRAY[0.5, NULL]) FROM intvals;
+SELECT percentiles(i, '[0:1][1:2]={{0.25,0.5},{0.75,1}}'::float8[]) FROM generate_series(1, 100) AS t(i);
+SELECT percentiles(val, ARRAY[0.1, 0.5]) FROM textvals;
+SELECT percentiles(val, ARRAY[1.5]) FROM intvals; -- fails
+
+-- Weighted median
+SELECT median(val, 2) FROM intvals;
+SELECT median(val, color) FROM textvals WHERE val <> 'extra';
+SELECT median(val, w) FROM (VALUES (1, 3), (2, 1), (10, 1), (NULL, 5), (7, NULL), (4, 0)) AS t(val, w);
+SELECT median(val, -1) FROM intvals; -- fails
+
+-- Approximate median
+SELECT approx_median(val) FROM intvals;
+SELECT approx_median(val, 0.001) FROM intvals;
+SELECT approx_median(val, 2) FROM intvals; -- fails
+SELECT approx_median(val) FROM textvals;
+
+-- Low-cardinality integers are counted rather than kept
+SELECT median(i % 121) FROM generate_series(1, 100000) AS t(i);
+SELECT percentiles(i % 121, ARRAY[0.5, 0.9]) FROM generate_series(1, 100000) AS t(i);
+
+-- Reverse-sorted values and values with a sentinel in 40% of the rows
+SELECT median((100001 - i)::float8) FROM generate_series(1, 100000) AS t(i);
+SELECT median(CASE WHEN i % 5 < 2 THEN -1 ELSE i END::float8) FROM generate_series(1, 100000) AS t(i);
+SELECT median(CASE WHEN i % 5 < 2 THEN 'zzz' ELSE lpad(i::text, 6, '0') END) FROM generate_series(0, 100000) AS t(i);
+
 -- Test large table with timestamps
 CREATE TABLE timestampvals (val timestamptz);
 
@@ -62,6 +134,57 @@ FROM generate_series(0, 100000) as T(i);
 
 SELECT median(val) FROM timestampvals;
 
+-- Values spill to disk once the state exceeds work_mem
+SET work_mem = '64kB';
+SELECT median(val) FROM timestampvals;
+SELECT median(i) FROM generate_series(1, 100000) AS t(i);
+SELECT median(lpad(i::text, 6, '0')) FROM generate_series(0, 100000) AS t(i);
+SELECT percentiles(i, ARRAY[0.5, 0.9, 0.99]) FROM generate_series(1, 100000) AS t(i);
+SELECT median(i, i % 4) FROM generate_series(1, 100000) AS t(i);
+SELECT median(lpad((i % 3)::text, 3, '0')) FROM generate_series(0, 100000) AS t(i);
+-- Repetitions of values are kept once along with their number
+SELECT median((i / 100)::float8) FROM generate_series(1, 100000) AS t(i);
+RESET work_mem;
+
+-- Statistics of the last state
+SET median.track_stats = on;
+SELECT median(i) FROM generate_series(1, 1000) AS t(i);
+SELECT path, values_num, resizes, spills, combines, comparisons FROM median_last_stats();
+SELECT percentiles(lpad(i::text, 4, '0'), ARRAY[0.5]) FROM generate_series(1, 1000) AS t(i);
+SELECT path, values_num, comparisons > 0 AS compared FROM median_last_stats();
+-- Runs of equal values read from a table are kept once
+CREATE TABLE textruns AS SELECT lpad((i / 1000)::text, 4, '0') AS val FROM generate_series(0, 100000) AS t(i);
+SELECT median(val) FROM textruns;
+SELECT values_num, memory_bytes < 100000 AS compressed FROM median_last_stats();
+RESET median.track_stats;
+
+-- Partial states stored as median_state
+SELECT '\x4d4544530103000000001700000000'::median_state;
+SELECT '\x00'::median_state; -- fails
+SELECT '\x4d4544530203000000001700000000'::median_state; -- fails
+SELECT median_final('\x4d45445301030000000017000000000000000100000000'::median_state, NULL::int4); -- fails
+SELECT median_final('\x4d45445301030100000017000000000000000000000000'::median_state, NULL::int4); -- fails
+SELECT median_final('\x4d4544530103000000001700000000000000000000000100000000000000010000000000000000'::median_state, NULL::int4); -- fails
+SELECT median_final('\x4d454453010300000000170000000000000000000000020000000000000001ffffffffffffffff00000000000000020000000000000001'::median_state, NULL::int4); -- fails
+SELECT median_final('\x4d45445301010200000019000000640000000100000001610000000000000000'::median_state, NULL::text); -- fails
+SELECT median_final('\x4d45445301010200000019000000640000000200000001610000000162ffffffffffffffffffffffffffffffff'::median_state, NULL::text); -- fails
+
+-- Partial states merged and finalized
+WITH p AS (SELECT median_partial(i) AS s FROM generate_series(1, 10) AS t(i) GROUP BY i % 3)
+SELECT median_final(median_merge(s), NULL::int4) FROM p;
+WITH p AS (SELECT approx_median_partial(i) AS s FROM generate_series(1, 10) AS t(i) GROUP BY i % 3)
+SELECT median_final(median_merge(s), NULL::int4) FROM p;
+SELECT median_final(median_partial(i), NULL::text) FROM generate_series(1, 3) AS t(i); -- fails
+SELECT median_merge(s) FROM (SELECT median_partial(1) UNION ALL SELECT approx_median_partial(1)) AS t(s); -- fails
+SELECT median_final(overlay(approx_median_partial(1)::bytea placing '\x0000000000000002' from 20)::text::median_state, NULL::int4); -- fails
+-- A sorted state merged into counts, which then exceed work_mem
+CREATE TABLE runparts AS
+SELECT median_partial(CASE WHEN i < 65536 THEN i / 7 ELSE 9362 END) AS s FROM generate_series(0, 131071) AS t(i)
+UNION ALL SELECT median_partial(5) FROM generate_series(1, 2048);
+SET work_mem = 256;
+SELECT median_final(median_merge(s), NULL::int4) FROM runparts;
+RESET work_mem;
+
 -- Force use of parallelism
 ALTER TABLE timestampvals set (parallel_workers = 4);
 SET parallel_setup_cost = 0;
@@ -69,3 +192,24 @@ SET max_parallel_workers_per_gather = 4;
 
 EXPLAIN (COSTS OFF) SELECT median(val) FROM timestampvals;
 SELECT median(val) FROM timestampvals;
+
+-- Text values sorted by parallel workers
+CREATE TABLE textpar AS SELECT lpad(i::text, 6, '0') AS val FROM generate_series(0, 100000) AS t(i);
+ALTER TABLE textpar SET (parallel_workers = 4);
+SELECT median(val) FROM textpar;
+SELECT percentiles(val, ARRAY[0.5, 0.99]) FROM textpar;
+
+-- Counts of low-cardinality integers merged from parallel workers
+CREATE TABLE agevals AS SELECT i % 121 AS val FROM generate_series(1, 100000) AS t(i);
+ALTER TABLE agevals SET (parallel_workers = 4);
+SELECT median(val) FROM agevals;
+
+-- Runs of equal values and weights sorted by parallel workers
+CREATE TABLE clusterpar AS SELECT lpad((i / 1000)::text, 4, '0') AS val, i / 1000 + 1 AS weight FROM generate_series(0, 100000) AS t(i);
+ALTER TABLE clusterpar SET (parallel_workers = 4);
+SELECT median(val, weight) FROM clusterpar;
+SELECT percentiles(val, ARRAY[0.1, 0.9]) FROM clusterpar;
+
+-- Rank error of approximate median is within the bound
+SELECT abs(extract(epoch FROM approx_median(val) - median(val))) < 0.0133 * 100001
+FROM timestampvals;